@@ -0,0 +1,35 @@
+#pragma once
+
+#include "llvm/ADT/DenseMap.h"
+#include <functional>
+
+namespace llvm {
+class BlockFrequencyInfo;
+class Function;
+class Module;
+} // namespace llvm
+
+// Estimated number of invocations of every defined function of a module.
+//
+// When the module carries profile entry counts (clang -fprofile-instr-use or
+// opt -pgo-instr-use with a .profdata file) those counts are used as they
+// are. Otherwise every function that is not called directly inside the module
+// (main, callbacks, exported API) is assumed to run once, and call-site block
+// frequencies are propagated top-down over the call graph. Static estimates
+// are therefore relative to one run of each root.
+class CallFrequency {
+public:
+  using BFIGetter = std::function<llvm::BlockFrequencyInfo &(llvm::Function &)>;
+
+  void compute(llvm::Module &M, const BFIGetter &getBFI);
+
+  // 0 for functions that were not part of the computation
+  double getFrequency(const llvm::Function *F) const;
+
+  bool hasProfile() const { return profile; }
+  bool empty() const { return frequency.empty(); }
+
+private:
+  llvm::DenseMap<const llvm::Function *, double> frequency;
+  bool profile = false;
+};
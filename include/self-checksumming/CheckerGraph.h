@@ -0,0 +1,74 @@
+#pragma once
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace llvm {
+class Function;
+} // namespace llvm
+
+// The network of checkers: an edge checker -> checkee means that the checker
+// hashes the checkee. Functions are numbered densely and both directions are
+// kept in compressed sparse row form, i.e. the checkees of node n are
+// checkeeIds[checkeeOffsets[n] .. checkeeOffsets[n + 1]) and likewise for the
+// checkers. The graph is immutable, it is put together with a Builder.
+class CheckerGraph {
+public:
+  using NodeId = uint32_t;
+  static constexpr NodeId NoNode = ~0u;
+
+  class Builder {
+  public:
+    // Nodes are numbered in the order they are first added
+    NodeId addNode(llvm::Function *F);
+    // The checkees of a checker keep the order of their edges
+    void addEdge(llvm::Function *checker, llvm::Function *checkee);
+    CheckerGraph build();
+
+  private:
+    std::vector<llvm::Function *> nodes;
+    llvm::DenseMap<const llvm::Function *, NodeId> ids;
+    std::vector<std::pair<NodeId, NodeId>> edges;
+  };
+
+  size_t size() const { return nodes.size(); }
+  size_t numEdges() const { return checkeeIds.size(); }
+  llvm::ArrayRef<llvm::Function *> functions() const { return nodes; }
+  llvm::Function *function(NodeId node) const { return nodes[node]; }
+  NodeId lookup(const llvm::Function *F) const {
+    auto it = ids.find(F);
+    return it == ids.end() ? NoNode : it->second;
+  }
+
+  llvm::ArrayRef<NodeId> checkees(NodeId node) const {
+    return range(checkeeOffsets, checkeeIds, node);
+  }
+  llvm::ArrayRef<NodeId> checkers(NodeId node) const {
+    return range(checkerOffsets, checkerIds, node);
+  }
+  bool isChecker(NodeId node) const {
+    return checkeeOffsets[node] != checkeeOffsets[node + 1];
+  }
+  bool isChecker(const llvm::Function *F) const {
+    NodeId node = lookup(F);
+    return node != NoNode && isChecker(node);
+  }
+
+private:
+  static llvm::ArrayRef<NodeId> range(const std::vector<uint32_t> &offsets,
+                                      const std::vector<NodeId> &targets,
+                                      NodeId node) {
+    return llvm::ArrayRef<NodeId>(targets.data() + offsets[node],
+                                  offsets[node + 1] - offsets[node]);
+  }
+
+  std::vector<llvm::Function *> nodes;
+  llvm::DenseMap<const llvm::Function *, NodeId> ids;
+  std::vector<uint32_t> checkeeOffsets{0};
+  std::vector<NodeId> checkeeIds;
+  std::vector<uint32_t> checkerOffsets{0};
+  std::vector<NodeId> checkerIds;
+};
@@ -1,6 +1,8 @@
 #include "list"
 #include "map"
 #include "vector"
+#include <random>
+#include "self-checksumming/CheckerGraph.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Module.h"
 #include <cstdlib>
@@ -21,14 +23,14 @@ protected:
   //int AllFunctions;
 
 public:
-  virtual std::map<Function *,
-                   std::vector<Function *>> constructProtectionNetwork(std::vector<Function *> sensitiveFunctions,
-                                                                       std::vector<Function *> allFunctions,
-                                                                       int connectivity) = 0;
-  virtual std::list<Function *> getReverseTopologicalSort(std::map<Function *, std::vector<Function *>>) = 0;
-  virtual void dumpJson(std::map<Function *, std::vector<Function *>>,
-                        std::string filePath, std::list<Function *> reverseTopologicalSort) = 0;
-  virtual std::map<Function *, std::vector<Function *>> loadJson(std::string filePath,
-                                                                 llvm::Module &module,
-                                                                 std::list<Function *> &reverseTopologicalSort) = 0;
+  virtual CheckerGraph constructProtectionNetwork(std::vector<Function *> sensitiveFunctions,
+                                                  std::vector<Function *> allFunctions,
+                                                  int connectivity,
+                                                  std::default_random_engine &rng) = 0;
+  virtual std::vector<CheckerGraph::NodeId> getReverseTopologicalSort(const CheckerGraph &) = 0;
+  virtual void dumpJson(const CheckerGraph &, const std::string &filePath,
+                        const std::vector<CheckerGraph::NodeId> &reverseTopologicalSort) = 0;
+  virtual CheckerGraph loadJson(const std::string &filePath,
+                                llvm::Module &module,
+                                std::vector<CheckerGraph::NodeId> &reverseTopologicalSort) = 0;
 };
@@ -3,6 +3,7 @@
 #include "list"
 #include "map"
 #include "vector"
+#include <random>
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/Debug.h"
@@ -20,6 +21,17 @@
 
 using namespace llvm;
 class DAGCheckersNetwork : protected CheckersNetworkBase {
+public:
+  // How checkers are picked for each checkee. Random draws them uniformly,
+  // MinCost picks the ones whose guards cost the least, i.e. the coldest
+  // checkers that carry fewer guards than the cap (see setCostModel and
+  // setMaxGuardsPerChecker). Connectivity is the hard constraint for both.
+  enum class Strategy { Random, MinCost };
+  // Encoding of dumped networks. Binary holds a string table of the function
+  // names, the checker -> checkee edges in CSR form and the topological
+  // order; it is mmapped when loaded.
+  enum class NetworkFormat { Json, Binary };
+
 protected:
   //  std::map<int, std::vector<int>> checkerCheckeeMap;
   //void topologicalSortUtil(int v, std::unique_ptr<bool[]> &visited,
@@ -28,16 +40,50 @@ protected:
   void printVector(std::vector<int> vector) override;
   // int AllFunctions;
   bool accept_lower_connectivity = false;
+  bool echo_network = false;
+  Strategy strategy = Strategy::Random;
+  std::map<Function *, double> checkerFrequency;
+  std::map<Function *, long> checkeeSize;
+  std::map<Function *, std::vector<Function *>> pinnedCheckers;
+  std::vector<Function *> checkeeOrder;
+  size_t maxGuardsPerChecker = 0;
+
+  // 0 for functions the cost model does not know
+  double frequencyOf(Function *F) const;
+  double guardCost(Function *checker, Function *checkee) const;
 public:
-  std::map<Function *, std::vector<Function *>> constructProtectionNetwork(std::vector<Function *> sensitiveFunctions,
-                                                                           std::vector<Function *> checkerFunctions,
-                                                                           int connectivity) override;
-  void dumpJson(std::map<Function *, std::vector<Function *>>,
-                std::string filePath,
-                std::list<Function *> reverseTopologicalSort) override;
-  std::list<Function *> getReverseTopologicalSort(std::map<Function *, std::vector<Function *>>) override;
-  std::map<Function *, std::vector<Function *>>
-  loadJson(std::string filePath, llvm::Module &module,
-           std::list<Function *> &reverseTopologicalSort) override;
+  CheckerGraph constructProtectionNetwork(std::vector<Function *> sensitiveFunctions,
+                                          std::vector<Function *> checkerFunctions,
+                                          int connectivity,
+                                          std::default_random_engine &rng) override;
+  void dumpJson(const CheckerGraph &graph, const std::string &filePath,
+                const std::vector<CheckerGraph::NodeId> &reverseTopologicalSort) override;
+  std::vector<CheckerGraph::NodeId> getReverseTopologicalSort(const CheckerGraph &graph) override;
+  CheckerGraph loadJson(const std::string &filePath, llvm::Module &module,
+                        std::vector<CheckerGraph::NodeId> &reverseTopologicalSort) override;
+  void dumpBinary(const CheckerGraph &graph, const std::string &filePath,
+                  const std::vector<CheckerGraph::NodeId> &reverseTopologicalSort);
+  CheckerGraph loadBinary(const std::string &filePath, llvm::Module &module,
+                          std::vector<CheckerGraph::NodeId> &reverseTopologicalSort);
+  static bool isBinaryNetwork(const std::string &filePath);
   void setLowerConnectivityAcceptance(bool);
+  // Also print networks that are dumped or loaded to stdout
+  void setNetworkEcho(bool);
+  void setStrategy(Strategy value);
+  // The expected cost of a guard is how often its checker runs times the size
+  // of the checkee it hashes
+  void setCostModel(std::map<Function *, double> frequency,
+                    std::map<Function *, long> size);
+  // Guards a MinCost checker carries before warmer ones are taken, 0 for
+  // twice the even share. The cap doubles when no checker is below it.
+  void setMaxGuardsPerChecker(size_t value);
+  // Checkers a sensitive function gets before any others are picked, as long
+  // as they are still available when it is placed. Sensitive functions are
+  // then placed in the given order for either strategy; a pinned network
+  // stays acyclic if the pinned checkees come first in the order they were
+  // placed in when their checkers were picked.
+  void setPinnedCheckers(std::map<Function *, std::vector<Function *>> checkers);
+  // The order in which the last constructed network placed the sensitive
+  // functions
+  const std::vector<Function *> &getCheckeeOrder() const;
 };
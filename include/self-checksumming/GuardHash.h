@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Hash algorithms a guard can use to check its checkee. The numbering is
+// shared with enum sc_hash_kind in rtlib.c and the names with the patch guide
+// and patcher/dump_pipe.py.
+enum class GuardHash { XOR = 0, CRC32C = 1, Adler32 = 2, Mix64 = 3 };
+
+// Name recorded in the patch guide, e.g. "crc32c"
+const char *guardHashName(GuardHash hash);
+
+// rtlib.c entry point taking (address, length, expectedHash)
+const char *guardHashEntryPoint(GuardHash hash);
+
+bool parseGuardHash(const std::string &name, GuardHash &hash);
+
+// Hash of a checkee exactly as rtlib.c's sc_hash computes it at run time
+uint32_t computeGuardHash(GuardHash hash, const uint8_t *data, size_t length);
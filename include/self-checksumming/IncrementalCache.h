@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace llvm {
+class Function;
+} // namespace llvm
+
+// Hash of the IR of a function that is stable across builds: opcodes, types,
+// constants, the names of referenced globals and the shape of the use-def
+// graph go in, value names and the function's own name do not. Compute it
+// before the function is instrumented.
+uint64_t structuralHash(const llvm::Function &F);
+
+// State of the previous build kept by -sc-incremental-cache: the structural
+// hash of every sensitive function, the order in which the network placed
+// them and the checkers each of them got. A sensitive function whose hash did
+// not change keeps its checkers in the next build.
+class IncrementalCache {
+public:
+  bool read(const std::string &path);
+  bool write(const std::string &path) const;
+
+  // false if the function was not in the previous build
+  bool lookup(const std::string &function, uint64_t &hash) const {
+    auto it = hashes.find(function);
+    if (it == hashes.end())
+      return false;
+    hash = it->second;
+    return true;
+  }
+
+  std::map<std::string, uint64_t> hashes;
+  std::vector<std::string> order;
+  std::map<std::string, std::vector<std::string>> checkers;
+};
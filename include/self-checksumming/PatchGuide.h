@@ -0,0 +1,60 @@
+#pragma once
+
+#include "self-checksumming/GuardHash.h"
+#include <map>
+#include <string>
+#include <vector>
+
+// One line of guide.txt, written by SCPass for every guard:
+//   name,address_placeholder,length_placeholder,hash_placeholder,algorithm
+// followed by ",tableIndex" for guards whose descriptor is in sc_guard_table.
+struct GuardPatch {
+  std::string function;
+  unsigned int addressPlaceholder = 0;
+  unsigned int sizePlaceholder = 0;
+  unsigned int hashPlaceholder = 0;
+  GuardHash hash = GuardHash::XOR;
+  int tableIndex = -1;
+};
+
+// Name a checkee is recorded under in the patch guide: the demangled name
+// with blanks removed and punctuation replaced by '_'
+std::string demangle_name(const std::string &name);
+
+// guide.txt line of a patch, without the trailing newline
+std::string formatPatchGuideLine(const GuardPatch &patch);
+
+// Text is the comma separated guide.txt. Binary is a header
+//   "SCG1", u32 entries, u32 name bytes
+// followed by the NUL terminated checkee names and one record of six
+// little-endian u32 per guard: {name offset, address, length and hash
+// placeholders, algorithm, table index (0xFFFFFFFF for inline guards)}.
+enum class PatchGuideFormat { Text, Binary };
+
+// Reads a guide in either format, returns false and prints the offending
+// entry on errors
+bool readPatchGuide(const std::string &path, std::vector<GuardPatch> &patches);
+
+// Collects the guide entries of a module in memory, the guide is written once
+// when the pass finishes
+class PatchGuideWriter {
+public:
+  void add(const std::string &symbol, unsigned int addressPlaceholder,
+           unsigned int sizePlaceholder, unsigned int hashPlaceholder,
+           GuardHash hash, int tableIndex = -1);
+
+  // Demangled name the guide records for symbol, computed once per symbol
+  const std::string &guideName(const std::string &symbol);
+
+  // Text entries are appended to path like the per-guard writes used to, the
+  // binary format holds one header and replaces the file
+  bool write(const std::string &path, PatchGuideFormat format) const;
+
+  size_t size() const { return patches.size(); }
+
+private:
+  bool writeBinary(const std::string &path) const;
+
+  std::vector<GuardPatch> patches;
+  std::map<std::string, std::string> guideNames;
+};
@@ -1,8 +1,65 @@
-#include <fstream>
-#include <map>
+#pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Placeholder -> patched value tables of a protected binary, read by
+// SCPatchPass. The placeholders are allocated from consecutive counters (see
+// address_begin, size_begin and expected_hash_begin in SC.cpp), so each kind
+// is a dense array indexed by placeholder - base.
+//
+// Two encodings are accepted: the patch_guide JSON array the patchers dump,
+// and a binary manifest that is mmapped and looked up in place:
+//   "SCM1", {u32 base, u32 count} for address, size and hash,
+//   then per kind u32 targets[count] and a presence bitmap of
+//   (count + 31) / 32 u32 words, all little-endian.
 class PatchManifest {
 public:
-  std::map<int, int> address_patches, size_patches, hash_patches;
-  void readPatchManifest(const std::string &manifestFilePath);
+  enum Kind { Address = 0, Size = 1, Hash = 2, NumKinds = 3 };
+
+  PatchManifest() = default;
+  PatchManifest(const PatchManifest &) = delete;
+  PatchManifest &operator=(const PatchManifest &) = delete;
+  ~PatchManifest();
+
+  // Loads the binary manifest if the file holds one, the JSON array otherwise
+  bool readPatchManifest(const std::string &manifestFilePath);
+  bool writeBinaryManifest(const std::string &manifestFilePath) const;
+
+  // Sizes the table of kind for placeholders low..high, adding placeholders
+  // below the current base shifts the whole table otherwise
+  void reserve(Kind kind, uint32_t low, uint32_t high);
+  void add(Kind kind, uint32_t placeholder, uint32_t target);
+  bool lookup(Kind kind, uint32_t placeholder, uint32_t &target) const {
+    const Table &table = tables[kind];
+    uint32_t index = placeholder - table.base;
+    if (index >= table.count ||
+        !(table.present[index / 32] & (1u << (index % 32)))) {
+      return false;
+    }
+    target = table.targets[index];
+    return true;
+  }
+  size_t size(Kind kind) const;
+
+private:
+  struct Table {
+    uint32_t base = 0;
+    uint32_t count = 0;
+    // point into the mapping or into the vectors below
+    const uint32_t *targets = nullptr;
+    const uint32_t *present = nullptr;
+    std::vector<uint32_t> targetStorage;
+    std::vector<uint32_t> presentStorage;
+  };
+
+  bool readBinaryManifest(const std::string &manifestFilePath);
+  bool readJsonManifest(const std::string &manifestFilePath);
+  void unmap();
+
+  Table tables[NumKinds];
+  void *mapping = nullptr;
+  size_t mappingSize = 0;
 };
@@ -15,6 +15,14 @@ private:
   int numberOfGuards = 0;
   int numberOfGuardInstructions = 0;
   int desiredConnectivity = 1;
+  struct Phase {
+    std::string name;
+    double wallTime;
+    double userTime;
+    double systemTime;
+    long peakRssKb;
+  };
+  std::vector<Phase> phases;
 public:
   void setNumberOfSensitiveInstructions(long);
   void calculateConnectivity(std::vector<int>);
@@ -25,5 +33,8 @@ public:
   void setStdConnectivity(double);
   void addNumberOfGuards(int);
   void addNumberOfGuardInstructions(int);
+  // Seconds spent in a phase of the pass and the peak RSS at its end
+  void addPhase(const std::string &name, double wallTime, double userTime,
+                double systemTime, long peakRssKb);
   void dumpJson(const std::string &fileName);
 };
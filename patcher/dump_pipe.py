@@ -6,6 +6,7 @@ import os
 import base64
 import os.path
 import json
+import zlib
 from pprint import pprint
 
 debug_mode = False
@@ -22,32 +23,92 @@ def dump_debug_info(*args):
         print text
 
 
-def precompute_hash(r2, offset, size):
-    dump_debug_info('Precomputing hash')
+# Hash family shared with rtlib.c (sc_hash) and SCPass (-sc-hash)
+MASK64 = 0xFFFFFFFFFFFFFFFF
+MIX64_P1 = 0x9E3779B185EBCA87
+MIX64_P2 = 0xC2B2AE3D27D4EB4F
+MIX64_P3 = 0x165667B19E3779F9
+MIX64_P4 = 0x85EBCA77C2B2AE63
+MIX64_P5 = 0x27D4EB2F165667C5
+
+
+def make_crc32c_table():
+    table = []
+    for i in range(256):
+        crc = i
+        for _ in range(8):
+            if crc & 1:
+                crc = (crc >> 1) ^ 0x82F63B78
+            else:
+                crc >>= 1
+        table.append(crc)
+    return table
+
+
+CRC32C_TABLE = make_crc32c_table()
+
+
+def hash_xor(func_bytes):
     h = 0
-    dump_debug_info("p6e {}@{}".format(size, offset))
-    b64_func = r2.cmd("p6e {}@{}".format(size, offset))
-    func_bytes = bytearray(base64.b64decode(b64_func))
     for b in func_bytes:
         # sys.stdout.write("%x "%b)
         h = h ^ b
-    dump_debug_info('hash:', hex(h))
     return h
 
 
-def find_placeholder_sequential(mm, start_index, struct_flag, search_value):
-    search_bytes = struct.pack(struct_flag, search_value);
-    addr = mm.find(search_bytes, start_index)
-    return addr
+def hash_crc32c(func_bytes):
+    crc = 0xFFFFFFFF
+    for b in func_bytes:
+        crc = CRC32C_TABLE[(crc ^ b) & 0xFF] ^ (crc >> 8)
+    return crc ^ 0xFFFFFFFF
 
 
-def find_placeholder(mm, struct_flag, search_value):
-    search_bytes = struct.pack(struct_flag, search_value);
-    addr = mm.find(search_bytes)
-    if addr == -1:
-        mm.seek(0)
-    addr = mm.find(search_bytes)
-    return addr
+def hash_adler32(func_bytes):
+    return zlib.adler32(bytes(func_bytes)) & 0xFFFFFFFF
+
+
+def rotl64(x, r):
+    return ((x << r) | (x >> (64 - r))) & MASK64
+
+
+def hash_mix64(func_bytes):
+    h = MIX64_P5
+    words = len(func_bytes) // 8
+    for w in struct.unpack_from('<{}Q'.format(words), bytes(func_bytes)):
+        h ^= (rotl64((w * MIX64_P2) & MASK64, 31) * MIX64_P1) & MASK64
+        h = (rotl64(h, 27) * MIX64_P1 + MIX64_P4) & MASK64
+    for b in func_bytes[words * 8:]:
+        h ^= (b * MIX64_P5) & MASK64
+        h = (rotl64(h, 11) * MIX64_P1) & MASK64
+    h ^= len(func_bytes)
+    h ^= h >> 33
+    h = (h * MIX64_P2) & MASK64
+    h ^= h >> 29
+    h = (h * MIX64_P3) & MASK64
+    h ^= h >> 32
+    return (h ^ (h >> 32)) & 0xFFFFFFFF
+
+
+HASH_ALGORITHMS = {'xor': hash_xor,
+                   'crc32c': hash_crc32c,
+                   'adler32': hash_adler32,
+                   'mix64': hash_mix64}
+
+
+def precompute_hash(r2, offset, size, algorithm='xor'):
+    dump_debug_info('Precomputing hash')
+    dump_debug_info("p6e {}@{}".format(size, offset))
+    b64_func = r2.cmd("p6e {}@{}".format(size, offset))
+    func_bytes = bytearray(base64.b64decode(b64_func))
+    h = HASH_ALGORITHMS[algorithm](func_bytes)
+    dump_debug_info('hash:', hex(h))
+    return h
+
+
+def empty_region_hash(algorithm):
+    # dummy guards hash a zero-length region, which is not 0 for every
+    # algorithm (adler32 starts at 1, mix64 is seeded)
+    return HASH_ALGORITHMS[algorithm](bytearray())
 
 
 def patch_address(mm, addr, patch_value):
@@ -55,43 +116,97 @@ def patch_address(mm, addr, patch_value):
     mm.write(patch_value)
 
 
+# -sc-patch-guide-format=binary, see PatchGuideFormat in PatchGuide.h
+BINARY_GUIDE_MAGIC = 'SCG1'
+GUIDE_ALGORITHMS = ['xor', 'crc32c', 'adler32', 'mix64']
+
+
+def read_binary_guide(data):
+    # returns the guide as the lines of the text format
+    entries, names_size = struct.unpack_from('<II', data, 4)
+    names = data[12:12 + names_size]
+    lines = []
+    for i in range(entries):
+        name, add, size, hash_ph, algorithm, table_index = struct.unpack_from(
+            '<IIIIII', data, 12 + names_size + i * 24)
+        line = '{},{},{},{},{}'.format(names[name:names.index('\0', name)], add, size, hash_ph,
+                                       GUIDE_ALGORITHMS[algorithm])
+        if table_index != 0xFFFFFFFF:
+            line += ',{}'.format(table_index)
+        lines.append(line)
+    return lines
+
+
 def find_all_placeholders(mm, guard_patches):
+    # The placeholders are consecutive counters, so the sought values share a
+    # handful of upper half-words. One scan per distinct upper half-word finds
+    # every candidate, and only candidates are looked up in the sought set,
+    # instead of one scan of the whole binary per placeholder.
     placeholder_addresses = {}
     for patch in guard_patches:
-        for placeholder in patch:
-            struct_flag = ''
-            address = -1
-            if placeholder == 'add_placeholder' or placeholder == 'hash_placeholder':
-                struct_flag = '<I'
-            elif placeholder == 'size_placeholder':
-                struct_flag = '<I'
-            if struct_flag != '':
-                placeholder_value = patch[placeholder]
-                address = find_placeholder(mm, struct_flag, placeholder_value)
-                if placeholder_value not in placeholder_addresses:
-                    placeholder_addresses[placeholder_value] = []
-                if address == -1:
-                    dump_debug_info("ERR. Failed to find placeholder {} in the binary".format(placeholder_value))
-                    exit(1)
-                while address != -1:
-                    placeholder_addresses[placeholder_value].append(address)
-                    start_index = address + 1
-                    address = find_placeholder_sequential(mm, start_index, struct_flag, placeholder_value)
-
-    found_addresses = 0
-    pmap = {}
-    for paddress in placeholder_addresses:
-        count_placeholders = len(placeholder_addresses[paddress])
-        for address in placeholder_addresses[paddress]:
-            if address in pmap:
-                pholder = pmap[address]
-                if pholder != paddress:
-                    print "ERR. Same address mapped to two placehoders", pholder, paddress
-                    exit(1)
-        found_addresses = found_addresses + count_placeholders
+        for placeholder in ('add_placeholder', 'size_placeholder', 'hash_placeholder'):
+            placeholder_addresses[patch[placeholder]] = []
+    high_halves = set(value >> 16 for value in placeholder_addresses)
+    for high in high_halves:
+        needle = struct.pack('<H', high)
+        pos = mm.find(needle, 2)
+        while pos != -1:
+            value = struct.unpack('<I', mm[pos - 2:pos + 2])[0]
+            if value in placeholder_addresses:
+                placeholder_addresses[value].append(pos - 2)
+            pos = mm.find(needle, pos + 1)
+
+    missing = 0
+    for value in sorted(placeholder_addresses):
+        addresses = placeholder_addresses[value]
+        addresses.sort()
+        if not addresses:
+            print "ERR. Failed to find placeholder {} in the binary".format(value)
+            missing += 1
+        elif len(addresses) > 1:
+            # all copies are patched
+            print "WARNING. Placeholder {} found {} times in the binary".format(value, len(addresses))
+    if missing:
+        exit(1)
     return placeholder_addresses
 
 
+# sc_guard_table entries are {address, length, hash, algorithm, every,
+# interval_us, chunk_bytes}, see struct sc_guard_desc in rtlib.c. Chunked
+# guards compare the hash of the whole checkee once they wrapped around, so
+# their expected value is the same one inline guards use.
+GUARD_DESC_SIZE = 28
+
+
+def find_guard_table(mm, table_patches):
+    # one search locates the whole table, every other descriptor sits at a
+    # fixed offset from the one we look for
+    first = table_patches[0]
+    search_bytes = struct.pack('<III', first['add_placeholder'], first['size_placeholder'],
+                               first['hash_placeholder'])
+    addr = mm.find(search_bytes, 0)
+    if addr == -1:
+        print 'ERR. Failed to find the guard table in the binary'
+        exit(1)
+    if mm.find(search_bytes, addr + 1) != -1:
+        print 'ERR. Guard descriptor {} found twice in the binary'.format(first['table_index'])
+        exit(1)
+    return addr - first['table_index'] * GUARD_DESC_SIZE
+
+
+def patch_table_entry(mm, table_base, patch, size_target, expected_hash):
+    global total_patches
+    entry = table_base + patch['table_index'] * GUARD_DESC_SIZE
+    placeholders = struct.unpack('<III', mm[entry:entry + 12])
+    if placeholders != (patch['add_placeholder'], patch['size_placeholder'], patch['hash_placeholder']):
+        print 'ERR. Guard descriptor {} does not hold the expected placeholders'.format(patch['table_index'])
+        return False
+    patch_address(mm, entry, struct.pack('<III', patch['add_target'], size_target, expected_hash))
+    dump_debug_info('Patched guard descriptor {}'.format(patch['table_index']))
+    total_patches += 3
+    return True
+
+
 def patch_placeholder(mm, struct_flag, addresses, placeholder_value, target_value):
     global total_patches
     # addr = find_placeholder(mm,struct_flag,placeholder_value)
@@ -142,10 +257,13 @@ guide_to_open = sys.argv[2]
 if not os.path.exists(guide_to_open):
     print 'ERR. patch guide file cannot be found!'
     exit(1)
-with open(guide_to_open) as f:
-    content = f.readlines()
+with open(guide_to_open, 'rb') as f:
+    guide_data = f.read()
 
-content = [x.strip() for x in content]
+if guide_data[:4] == BINARY_GUIDE_MAGIC:
+    content = read_binary_guide(guide_data)
+else:
+    content = [x.strip() for x in guide_data.splitlines() if x.strip()]
 dump_debug_info('conent: {}'.format(content))
 patches = []
 for c in content:
@@ -154,6 +272,13 @@ for c in content:
     add_placeholder = int(s[1])
     size_placeholder = int(s[2])
     hash_placeholder = int(s[3])
+    # guides written before -sc-hash existed carry no algorithm column
+    hash_algorithm = s[4] if len(s) > 4 else 'xor'
+    if hash_algorithm not in HASH_ALGORITHMS:
+        print 'ERR: unknown hash algorithm {} for {}'.format(hash_algorithm, target_func)
+        exit(1)
+    # -sc-guard-table guards name their descriptor in sc_guard_table
+    table_index = int(s[5]) if len(s) > 5 else -1
     if target_func not in funcs:
         target_func = 'sym.' + target_func
     if target_func in funcs:
@@ -166,7 +291,9 @@ for c in content:
                  'hash_placeholder': hash_placeholder,
                  'add_target': offset,
                  'size_target': size,
-                 'hash_target': 0, 'dummy': False}
+                 'hash_target': 0, 'hash_algorithm': hash_algorithm,
+                 'table_index': table_index,
+                 'function': s[0], 'dummy': False}
         patches.append(patch)
     else:
         r2.cmd('s ' + target_func)
@@ -186,7 +313,9 @@ for c in content:
                      'hash_placeholder': hash_placeholder,
                      'add_target': offset,
                      'size_target': size,
-                     'hash_target': 0, 'dummy': error}
+                     'hash_target': 0, 'hash_algorithm': hash_algorithm,
+                     'table_index': table_index,
+                     'function': s[0], 'dummy': error}
             patches.append(patch)
         else:
             pprint(funcs)
@@ -205,10 +334,27 @@ with open(sys.argv[1], 'r+b') as f:
     mm = mmap.mmap(f.fileno(), 0)
 
     # find addresses before starting to patch
-    addresses = find_all_placeholders(mm, patches)
+    inline_patches = [p for p in patches if p['table_index'] < 0]
+    table_patches = [p for p in patches if p['table_index'] >= 0]
+    addresses = find_all_placeholders(mm, inline_patches)
+    table_base = -1
+    if table_patches:
+        table_base = find_guard_table(mm, table_patches)
 
     dump_patch = []
     for patch in patches:
+        if patch['table_index'] >= 0:
+            size_target = patch['size_target']
+            expected_hash = precompute_hash(r2, patch['add_target'], patch['size_target'],
+                                            patch['hash_algorithm'])
+            if patch['dummy']:
+                size_target = 0
+                expected_hash = empty_region_hash(patch['hash_algorithm'])
+            patch['hash_target'] = expected_hash
+            if not patch_table_entry(mm, table_base, patch, size_target, expected_hash):
+                exit(1)
+            dump_patch.append(patch)
+            continue
         address_patch = patch_placeholder(mm, '<I', addresses, patch['add_placeholder'], patch['add_target'])
         if not address_patch:
             dump_debug_info("can't patch address")
@@ -219,9 +365,10 @@ with open(sys.argv[1], 'r+b') as f:
         if not size_patch:
             dump_debug_info("can't patch size")
 
-        expected_hash = precompute_hash(r2, patch['add_target'], patch['size_target'])
+        expected_hash = precompute_hash(r2, patch['add_target'], patch['size_target'],
+                                        patch['hash_algorithm'])
         if patch['dummy']:
-            expected_hash = 0
+            expected_hash = empty_region_hash(patch['hash_algorithm'])
 
         patch['hash_target'] = expected_hash
         hash_patch = patch_placeholder(mm, '<I', addresses, patch['hash_placeholder'], expected_hash)
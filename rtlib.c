@@ -1,7 +1,24 @@
+#define _GNU_SOURCE // pthread_setaffinity_np
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <execinfo.h>
 #include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "telemetry/sc_telemetry.h"
+#ifdef SC_PROFILE
+#include <dlfcn.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SC_X86 1
+#endif
 #define KNRM  "\x1B[0m"
 #define KRED  "\x1B[31m"
 #define KGRN  "\x1B[32m"
@@ -11,40 +28,1480 @@
 #define KCYN  "\x1B[36m"
 #define KWHT  "\x1B[37m"
 
-void guardMe(const unsigned int address, const unsigned int length, const unsigned int expectedHash) {
+/*
+ * Every function of the runtime is placed in .text.sc_runtime, which the
+ * linker merges into .text. SCPass recognizes the runtime by this section
+ * and never picks its functions as checkers or checkees when rtlib is linked
+ * before the pass runs.
+ */
+#define SC_RUNTIME __attribute__((section(".text.sc_runtime")))
 
-  const unsigned char *beginAddress = (const unsigned char *) address;
-  unsigned int visited = 0;
+/*
+ * Hash kernels.
+ *
+ * The guard hash is the XOR of all bytes of the checkee, which is what
+ * patcher/dump_pipe.py precomputes. XOR is associative, so the wide kernels
+ * fold the region into 64/128/256-bit accumulators and reduce the
+ * accumulator to a single byte at the end; every kernel yields exactly the
+ * same 8-bit value as the byte-by-byte loop.
+ */
+typedef unsigned char (*sc_xor_kernel_t)(const unsigned char *, unsigned int);
+
+SC_RUNTIME static unsigned char sc_fold64(uint64_t word) {
+  word ^= word >> 32;
+  word ^= word >> 16;
+  word ^= word >> 8;
+  return (unsigned char) word;
+}
+
+SC_RUNTIME static unsigned char sc_xor_byte(const unsigned char *p, unsigned int length) {
   unsigned char hash = 0;
-  //Note: Length need to be divided by the size of
-  //type of begin address that we are reading each time,
-  //otherwise it falls out of the scope (see #3)
-//	printf("%sLength:%d Begin address:%d Expectedhash:%d\n",KRED,length,address,expectedHash);
-  while (visited < length) {
-//		printf("%x ",*beginAddress);
-    hash ^= *beginAddress++;
-    ++visited;
+  while (length--) {
+    hash ^= *p++;
+  }
+  return hash;
+}
+
+SC_RUNTIME static unsigned char sc_xor_word(const unsigned char *p, unsigned int length) {
+  unsigned char hash = 0;
+  uint64_t acc0 = 0, acc1 = 0, acc2 = 0, acc3 = 0;
+  while (length && ((uintptr_t) p & 7)) {
+    hash ^= *p++;
+    --length;
+  }
+  for (; length >= 32; length -= 32, p += 32) {
+    uint64_t w[4];
+    memcpy(w, p, sizeof(w));
+    acc0 ^= w[0];
+    acc1 ^= w[1];
+    acc2 ^= w[2];
+    acc3 ^= w[3];
+  }
+  for (; length >= 8; length -= 8, p += 8) {
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    acc0 ^= w;
+  }
+  return hash ^ sc_fold64(acc0 ^ acc1 ^ acc2 ^ acc3) ^ sc_xor_byte(p, length);
+}
+
+#ifdef SC_X86
+SC_RUNTIME __attribute__((target("sse2")))
+static unsigned char sc_xor_sse2(const unsigned char *p, unsigned int length) {
+  unsigned char hash = 0;
+  __m128i acc0 = _mm_setzero_si128(), acc1 = _mm_setzero_si128();
+  uint64_t lanes[2];
+  while (length && ((uintptr_t) p & 15)) {
+    hash ^= *p++;
+    --length;
+  }
+  for (; length >= 32; length -= 32, p += 32) {
+    acc0 = _mm_xor_si128(acc0, _mm_load_si128((const __m128i *) p));
+    acc1 = _mm_xor_si128(acc1, _mm_load_si128((const __m128i *) (p + 16)));
+  }
+  acc0 = _mm_xor_si128(acc0, acc1);
+  _mm_storeu_si128((__m128i *) lanes, acc0);
+  return hash ^ sc_fold64(lanes[0] ^ lanes[1]) ^ sc_xor_word(p, length);
+}
+
+SC_RUNTIME __attribute__((target("avx2")))
+static unsigned char sc_xor_avx2(const unsigned char *p, unsigned int length) {
+  unsigned char hash = 0;
+  __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+  __m256i acc2 = _mm256_setzero_si256(), acc3 = _mm256_setzero_si256();
+  uint64_t lanes[4];
+  while (length && ((uintptr_t) p & 31)) {
+    hash ^= *p++;
+    --length;
+  }
+  for (; length >= 128; length -= 128, p += 128) {
+    acc0 = _mm256_xor_si256(acc0, _mm256_load_si256((const __m256i *) p));
+    acc1 = _mm256_xor_si256(acc1, _mm256_load_si256((const __m256i *) (p + 32)));
+    acc2 = _mm256_xor_si256(acc2, _mm256_load_si256((const __m256i *) (p + 64)));
+    acc3 = _mm256_xor_si256(acc3, _mm256_load_si256((const __m256i *) (p + 96)));
+  }
+  for (; length >= 32; length -= 32, p += 32) {
+    acc0 = _mm256_xor_si256(acc0, _mm256_load_si256((const __m256i *) p));
+  }
+  acc0 = _mm256_xor_si256(_mm256_xor_si256(acc0, acc1),
+                          _mm256_xor_si256(acc2, acc3));
+  _mm256_storeu_si256((__m256i *) lanes, acc0);
+  return hash ^ sc_fold64(lanes[0] ^ lanes[1] ^ lanes[2] ^ lanes[3]) ^
+         sc_xor_word(p, length);
+}
+
+SC_RUNTIME static int sc_cpu_has_avx2(void) {
+  unsigned int eax, ebx, ecx, edx;
+  unsigned int xcr0_lo, xcr0_hi;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return 0;
+  // AVX state must be enabled by the OS, otherwise ymm registers fault
+  if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+    return 0;
+  __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+  if ((xcr0_lo & 6) != 6)
+    return 0;
+  if (__get_cpuid_max(0, 0) < 7)
+    return 0;
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  return (ebx & bit_AVX2) != 0;
+}
+
+SC_RUNTIME static int sc_cpu_has_sse2(void) {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return 0;
+  return (edx & bit_SSE2) != 0;
+}
+
+SC_RUNTIME static int sc_cpu_has_sse42(void) {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return 0;
+  return (ecx & bit_SSE4_2) != 0;
+}
+
+SC_RUNTIME __attribute__((target("sse4.2")))
+static uint32_t sc_crc32c_sse42(uint32_t crc, const unsigned char *p,
+                                unsigned int length) {
+  while (length && ((uintptr_t) p & 7)) {
+    crc = _mm_crc32_u8(crc, *p++);
+    --length;
+  }
+#ifdef __x86_64__
+  for (; length >= 8; length -= 8, p += 8) {
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    crc = (uint32_t) _mm_crc32_u64(crc, w);
+  }
+#endif
+  for (; length >= 4; length -= 4, p += 4) {
+    uint32_t w;
+    memcpy(&w, p, sizeof(w));
+    crc = _mm_crc32_u32(crc, w);
+  }
+  while (length--) {
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+  return crc;
+}
+#endif
+
+/*
+ * Selectable hash family, see -sc-hash in SCPass and precompute_hash in
+ * patcher/dump_pipe.py. The numbering is shared with GuardHash.h. Every
+ * algorithm is written as init/update/final over a 64-bit state so that a
+ * region can also be hashed piecewise.
+ */
+enum sc_hash_kind {
+  SC_HASH_XOR = 0,
+  SC_HASH_CRC32C = 1,
+  SC_HASH_ADLER32 = 2,
+  SC_HASH_MIX64 = 3
+};
+
+typedef uint32_t (*sc_crc32c_kernel_t)(uint32_t, const unsigned char *,
+                                       unsigned int);
+
+static uint32_t sc_crc32c_table[256];
+
+SC_RUNTIME static void sc_crc32c_init_table(void) {
+  uint32_t i, j;
+  for (i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (j = 0; j < 8; ++j)
+      crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+    sc_crc32c_table[i] = crc;
+  }
+}
+
+SC_RUNTIME static uint32_t sc_crc32c_sw(uint32_t crc, const unsigned char *p,
+                             unsigned int length) {
+  while (length--) {
+    crc = sc_crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+SC_RUNTIME static sc_xor_kernel_t sc_select_xor_kernel(void) {
+  // SC_HASH_KERNEL=byte|word|sse2|avx2 pins a kernel, e.g. for benchmarking
+  const char *forced = getenv("SC_HASH_KERNEL");
+  if (forced && strcmp(forced, "byte") == 0)
+    return sc_xor_byte;
+  if (forced && strcmp(forced, "word") == 0)
+    return sc_xor_word;
+#ifdef SC_X86
+  if ((!forced || strcmp(forced, "avx2") == 0) && sc_cpu_has_avx2())
+    return sc_xor_avx2;
+  if (sc_cpu_has_sse2())
+    return sc_xor_sse2;
+#endif
+  return sc_xor_word;
+}
+
+SC_RUNTIME static sc_crc32c_kernel_t sc_select_crc32c_kernel(void) {
+  const char *forced = getenv("SC_HASH_KERNEL");
+#ifdef SC_X86
+  if ((!forced || (strcmp(forced, "byte") != 0 && strcmp(forced, "word") != 0)) &&
+      sc_cpu_has_sse42())
+    return sc_crc32c_sse42;
+#endif
+  (void) forced;
+  sc_crc32c_init_table();
+  return sc_crc32c_sw;
+}
+
+static unsigned char sc_xor_resolve(const unsigned char *p, unsigned int length);
+static uint32_t sc_crc32c_resolve(uint32_t crc, const unsigned char *p,
+                                  unsigned int length);
+static sc_xor_kernel_t sc_xor_kernel = sc_xor_resolve;
+static sc_crc32c_kernel_t sc_crc32c_kernel = sc_crc32c_resolve;
+
+// Guards may run from other constructors before ours, so the first call
+// through a pointer resolves the kernel as well.
+SC_RUNTIME static unsigned char sc_xor_resolve(const unsigned char *p, unsigned int length) {
+  sc_xor_kernel_t kernel = sc_select_xor_kernel();
+  __atomic_store_n(&sc_xor_kernel, kernel, __ATOMIC_RELAXED);
+  return kernel(p, length);
+}
+
+SC_RUNTIME static uint32_t sc_crc32c_resolve(uint32_t crc, const unsigned char *p,
+                                  unsigned int length) {
+  // release so that the software table is visible before the pointer
+  sc_crc32c_kernel_t kernel = sc_select_crc32c_kernel();
+  __atomic_store_n(&sc_crc32c_kernel, kernel, __ATOMIC_RELEASE);
+  return kernel(crc, p, length);
+}
+
+SC_RUNTIME __attribute__((constructor))
+static void sc_init_dispatch(void) {
+  __atomic_store_n(&sc_xor_kernel, sc_select_xor_kernel(), __ATOMIC_RELAXED);
+  __atomic_store_n(&sc_crc32c_kernel, sc_select_crc32c_kernel(),
+                   __ATOMIC_RELEASE);
+}
+
+#define SC_MIX64_P1 0x9E3779B185EBCA87ull
+#define SC_MIX64_P2 0xC2B2AE3D27D4EB4Full
+#define SC_MIX64_P3 0x165667B19E3779F9ull
+#define SC_MIX64_P4 0x85EBCA77C2B2AE63ull
+#define SC_MIX64_P5 0x27D4EB2F165667C5ull
+
+SC_RUNTIME static uint64_t sc_rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+// Adler-32 sums may be deferred for this many bytes before they overflow
+#define SC_ADLER32_NMAX 5552
+
+SC_RUNTIME static uint64_t sc_hash_init(enum sc_hash_kind kind) {
+  switch (kind) {
+  case SC_HASH_CRC32C:
+    return 0xFFFFFFFFu;
+  case SC_HASH_ADLER32:
+    return 1;
+  case SC_HASH_MIX64:
+    return SC_MIX64_P5;
+  default:
+    return 0;
+  }
+}
+
+// Mix64 consumes whole 8-byte words, a trailing partial word may only be
+// passed in the last update of a region.
+SC_RUNTIME static uint64_t sc_hash_update(enum sc_hash_kind kind, uint64_t state,
+                               const unsigned char *p, unsigned int length) {
+  switch (kind) {
+  case SC_HASH_CRC32C: {
+    sc_crc32c_kernel_t kernel =
+        __atomic_load_n(&sc_crc32c_kernel, __ATOMIC_ACQUIRE);
+    return kernel((uint32_t) state, p, length);
+  }
+  case SC_HASH_ADLER32: {
+    uint64_t a = state & 0xFFFFFFFFu, b = state >> 32;
+    while (length) {
+      unsigned int block = length < SC_ADLER32_NMAX ? length : SC_ADLER32_NMAX;
+      length -= block;
+      while (block--) {
+        a += *p++;
+        b += a;
+      }
+      a %= 65521;
+      b %= 65521;
+    }
+    return (b << 32) | a;
+  }
+  case SC_HASH_MIX64: {
+    for (; length >= 8; length -= 8, p += 8) {
+      uint64_t w;
+      memcpy(&w, p, sizeof(w));
+      state ^= sc_rotl64(w * SC_MIX64_P2, 31) * SC_MIX64_P1;
+      state = sc_rotl64(state, 27) * SC_MIX64_P1 + SC_MIX64_P4;
+    }
+    while (length--) {
+      state ^= *p++ * SC_MIX64_P5;
+      state = sc_rotl64(state, 11) * SC_MIX64_P1;
+    }
+    return state;
+  }
+  default: {
+    sc_xor_kernel_t kernel = __atomic_load_n(&sc_xor_kernel, __ATOMIC_RELAXED);
+    return state ^ kernel(p, length);
+  }
+  }
+}
+
+SC_RUNTIME static uint32_t sc_hash_final(enum sc_hash_kind kind, uint64_t state,
+                              unsigned int length) {
+  switch (kind) {
+  case SC_HASH_CRC32C:
+    return ~(uint32_t) state;
+  case SC_HASH_ADLER32:
+    return (uint32_t) (((state >> 32) << 16) | (state & 0xFFFF));
+  case SC_HASH_MIX64:
+    state ^= length;
+    state ^= state >> 33;
+    state *= SC_MIX64_P2;
+    state ^= state >> 29;
+    state *= SC_MIX64_P3;
+    state ^= state >> 32;
+    return (uint32_t) (state ^ (state >> 32));
+  default:
+    return (uint32_t) (state & 0xFF);
+  }
+}
+
+SC_RUNTIME static uint32_t sc_hash(enum sc_hash_kind kind, const unsigned char *p,
+                        unsigned int length) {
+  return sc_hash_final(kind, sc_hash_update(kind, sc_hash_init(kind), p, length),
+                       length);
+}
+
+// The XOR hash is only 8 bits wide, the placeholder it is patched into is not
+SC_RUNTIME static int sc_hash_matches(enum sc_hash_kind kind, uint32_t hash,
+                           uint32_t expectedHash) {
+  if (kind == SC_HASH_XOR)
+    return (unsigned char) hash == (unsigned char) expectedHash;
+  return hash == expectedHash;
+}
+
+SC_RUNTIME static void sc_response(void) {
+  printf("%sTampered binary!\n", KNRM);
+
+  void *callstack[128];
+  int i, frames = backtrace(callstack, 128);
+  char **strs = backtrace_symbols(callstack, frames);
+
+  for (i = 0; i < frames; ++i) {
+    printf("%s\n", strs[i]);
+  }
+
+  free(strs);
+  exit(777);
+}
+
+/*
+ * Runtime configuration, read once from the environment:
+ *   SC_CACHE_INTERVAL_MS  a region verified by one guard is not rehashed by
+ *                         any guard for this many milliseconds (0, the
+ *                         default, disables the verification cache)
+ *   SC_ASYNC              1 makes guards queue their region for a verifier
+ *                         thread instead of hashing it on the caller's thread
+ *   SC_ASYNC_CPU          core the verifier thread is pinned to (unpinned by
+ *                         default)
+ *   SC_QUEUE_SLOTS        capacity of the request ring, rounded up to a power
+ *                         of two (1024 by default)
+ *   SC_QUEUE_POLICY       what a guard does when the ring is full: sync (the
+ *                         default) verifies the region on the caller's
+ *                         thread, block waits for a free slot, drop discards
+ *                         the request (flooding guard calls then skips
+ *                         checks). coalesce behaves like sync and besides
+ *                         never queues a region that is already waiting
+ *   SC_TELEMETRY          1 publishes live per-guard counters in shared
+ *                         memory for telemetry/sc-telemetry
+ */
+enum sc_queue_policy {
+  SC_QUEUE_SYNC,
+  SC_QUEUE_COALESCE,
+  SC_QUEUE_BLOCK,
+  SC_QUEUE_DROP
+};
+
+#define SC_ASYNC_UNPINNED (~0u)
+
+struct sc_config {
+  unsigned int cache_interval_ms;
+  unsigned int async;
+  unsigned int async_cpu;
+  unsigned int queue_slots;
+  enum sc_queue_policy queue_policy;
+  unsigned int telemetry;
+};
+
+static struct sc_config sc_config;
+static int sc_config_state; // 0 unread, 1 being read, 2 ready
+
+SC_RUNTIME static unsigned int sc_env_uint(const char *name, unsigned int fallback) {
+  const char *value = getenv(name);
+  if (!value || !*value)
+    return fallback;
+  return (unsigned int) strtoul(value, NULL, 10);
+}
+
+SC_RUNTIME static enum sc_queue_policy sc_env_queue_policy(const char *name) {
+  const char *value = getenv(name);
+  if (value && !strcmp(value, "coalesce"))
+    return SC_QUEUE_COALESCE;
+  if (value && !strcmp(value, "block"))
+    return SC_QUEUE_BLOCK;
+  if (value && !strcmp(value, "drop"))
+    return SC_QUEUE_DROP;
+  return SC_QUEUE_SYNC;
+}
+
+SC_RUNTIME static void sc_load_config(struct sc_config *config) {
+  config->cache_interval_ms = sc_env_uint("SC_CACHE_INTERVAL_MS", 0);
+  config->async = sc_env_uint("SC_ASYNC", 0);
+  config->async_cpu = sc_env_uint("SC_ASYNC_CPU", SC_ASYNC_UNPINNED);
+  unsigned int slots = sc_env_uint("SC_QUEUE_SLOTS", 1024);
+  config->queue_slots = 2;
+  while (config->queue_slots < slots && config->queue_slots < (1u << 20))
+    config->queue_slots <<= 1;
+  config->queue_policy = sc_env_queue_policy("SC_QUEUE_POLICY");
+  config->telemetry = sc_env_uint("SC_TELEMETRY", 0);
+}
+
+SC_RUNTIME static const struct sc_config *sc_get_config(void) {
+  int state = __atomic_load_n(&sc_config_state, __ATOMIC_ACQUIRE);
+  if (state == 2)
+    return &sc_config;
+  if (state == 0 && __atomic_compare_exchange_n(&sc_config_state, &state, 1, 0,
+                                                __ATOMIC_ACQUIRE,
+                                                __ATOMIC_ACQUIRE)) {
+    sc_load_config(&sc_config);
+    __atomic_store_n(&sc_config_state, 2, __ATOMIC_RELEASE);
+    return &sc_config;
+  }
+  while (__atomic_load_n(&sc_config_state, __ATOMIC_ACQUIRE) != 2)
+    ;
+  return &sc_config;
+}
+
+/*
+ * Verification cache shared by all guards.
+ *
+ * With connectivity > 1 several checkers guard the same checkee with the same
+ * (address, length, expected hash). Time is divided into epochs of
+ * cache_interval_ms; a slot records that a region matched its expected hash
+ * during an epoch, and any guard of that region skips the rehash until the
+ * epoch moves on. A slot packs a 32-bit region tag and the epoch into one
+ * 64-bit word so that it is read and written atomically without locks.
+ * Colliding regions just evict each other and are rehashed.
+ */
+#define SC_CACHE_SLOTS 4096
+
+static uint64_t sc_cache[SC_CACHE_SLOTS];
+
+SC_RUNTIME static uint32_t sc_region_tag(enum sc_hash_kind kind, unsigned int address,
+                              unsigned int length, unsigned int expectedHash) {
+  uint64_t key = ((uint64_t) address << 32) | length;
+  key ^= ((uint64_t) expectedHash << 8) ^ (uint64_t) kind;
+  key *= SC_MIX64_P1;
+  key ^= key >> 29;
+  key *= SC_MIX64_P2;
+  key ^= key >> 32;
+  return (uint32_t) key | 1; // 0 marks an empty slot
+}
+
+SC_RUNTIME static uint64_t sc_now_us(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+SC_RUNTIME static uint32_t sc_cache_epoch(unsigned int interval_ms) {
+  return (uint32_t) (sc_now_us() / 1000 / interval_ms) + 1;
+}
+
+SC_RUNTIME static int sc_cache_verified(uint32_t tag, uint32_t epoch) {
+  uint64_t slot =
+      __atomic_load_n(&sc_cache[tag & (SC_CACHE_SLOTS - 1)], __ATOMIC_RELAXED);
+  return slot == (((uint64_t) tag << 32) | epoch);
+}
+
+SC_RUNTIME static void sc_cache_mark_verified(uint32_t tag, uint32_t epoch) {
+  __atomic_store_n(&sc_cache[tag & (SC_CACHE_SLOTS - 1)],
+                   ((uint64_t) tag << 32) | epoch, __ATOMIC_RELAXED);
+}
+
+/*
+ * Live telemetry (SC_TELEMETRY=1). The counters of every guarded region are
+ * kept in the shared memory object /sc-telemetry.<pid>, laid out as in
+ * telemetry/sc_telemetry.h, which sc-telemetry maps read-only while the
+ * process runs. The object is created on the first guard call and unlinked
+ * at exit. A forked child stops counting into its parent's object and
+ * creates /sc-telemetry.<child pid> on its own first guard call.
+ */
+static struct sc_telemetry *sc_telemetry;
+static pthread_once_t sc_telemetry_once = PTHREAD_ONCE_INIT;
+static char sc_telemetry_name[32];
+static pid_t sc_telemetry_owner; // process that created sc_telemetry_name
+
+SC_RUNTIME static void sc_telemetry_unlink(void) {
+  if (sc_telemetry_owner == getpid())
+    shm_unlink(sc_telemetry_name);
+}
+
+SC_RUNTIME static void sc_telemetry_atfork_child(void) {
+  if (sc_telemetry)
+    munmap(sc_telemetry, sizeof(struct sc_telemetry));
+  sc_telemetry = NULL;
+  sc_telemetry_owner = 0;
+  sc_telemetry_once = (pthread_once_t) PTHREAD_ONCE_INIT;
+}
+
+SC_RUNTIME static void sc_telemetry_open(void) {
+  static int registered;
+  if (!registered) {
+    // inherited by children, which unlink only objects they created
+    atexit(sc_telemetry_unlink);
+    pthread_atfork(NULL, NULL, sc_telemetry_atfork_child);
+    registered = 1;
+  }
+  snprintf(sc_telemetry_name, sizeof(sc_telemetry_name), SC_TELEMETRY_NAME,
+           (int) getpid());
+  int fd = shm_open(sc_telemetry_name, O_CREAT | O_TRUNC | O_RDWR, 0600);
+  if (fd < 0)
+    return;
+  void *mapping = MAP_FAILED;
+  if (!ftruncate(fd, sizeof(struct sc_telemetry)))
+    mapping = mmap(NULL, sizeof(struct sc_telemetry), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    shm_unlink(sc_telemetry_name);
+    return;
+  }
+  struct sc_telemetry *telemetry = mapping;
+  telemetry->slots = SC_TELEMETRY_SLOTS;
+  telemetry->pid = (uint64_t) getpid();
+  __atomic_store_n(&telemetry->magic, SC_TELEMETRY_MAGIC, __ATOMIC_RELEASE);
+  sc_telemetry_owner = getpid();
+  __atomic_store_n(&sc_telemetry, telemetry, __ATOMIC_RELEASE);
+}
+
+SC_RUNTIME static struct sc_telemetry_slot *
+sc_telemetry_slot(enum sc_hash_kind kind, unsigned int address,
+                  unsigned int length) {
+  if (!sc_get_config()->telemetry)
+    return NULL;
+  pthread_once(&sc_telemetry_once, sc_telemetry_open);
+  struct sc_telemetry *telemetry =
+      __atomic_load_n(&sc_telemetry, __ATOMIC_ACQUIRE);
+  if (!telemetry)
+    return NULL;
+  uint32_t tag = sc_region_tag(kind, address, length, 0);
+  unsigned int probe, i = tag;
+  for (probe = 0; probe < SC_TELEMETRY_SLOTS; ++probe, ++i) {
+    struct sc_telemetry_slot *slot =
+        &telemetry->slot[i & (SC_TELEMETRY_SLOTS - 1)];
+    uint32_t current = __atomic_load_n(&slot->tag, __ATOMIC_ACQUIRE);
+    if (current == 0 &&
+        __atomic_compare_exchange_n(&slot->tag, &current,
+                                    SC_TELEMETRY_CLAIMING, 0, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_ACQUIRE)) {
+      slot->address = address;
+      slot->length = length;
+      slot->algorithm = (uint32_t) kind;
+      __atomic_store_n(&slot->tag, tag, __ATOMIC_RELEASE);
+      return slot;
+    }
+    while (current == SC_TELEMETRY_CLAIMING)
+      current = __atomic_load_n(&slot->tag, __ATOMIC_ACQUIRE);
+    if (current == tag && slot->address == address && slot->length == length &&
+        slot->algorithm == (uint32_t) kind)
+      return slot;
+  }
+  __atomic_fetch_add(&telemetry->overflow, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+SC_RUNTIME static uint64_t sc_now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * The guard entry points look the slot of their region up once in
+ * sc_telemetry_call and pass it down to the cache hit and hash counters. The
+ * slot is NULL when telemetry is off or the slot table is full.
+ */
+SC_RUNTIME static struct sc_telemetry_slot *
+sc_telemetry_call(enum sc_hash_kind kind, unsigned int address,
+                  unsigned int length) {
+  struct sc_telemetry_slot *slot = sc_telemetry_slot(kind, address, length);
+  if (slot)
+    __atomic_fetch_add(&slot->calls, 1, __ATOMIC_RELAXED);
+  return slot;
+}
+
+SC_RUNTIME static void sc_telemetry_cache_hit(struct sc_telemetry_slot *slot) {
+  if (slot)
+    __atomic_fetch_add(&slot->cache_hits, 1, __ATOMIC_RELAXED);
+}
+
+// start_ns is sc_telemetry_start(slot) before the hash
+SC_RUNTIME static void sc_telemetry_hash(struct sc_telemetry_slot *slot,
+                              uint64_t start_ns) {
+  if (!slot)
+    return;
+  uint64_t ns = sc_now_ns() - start_ns;
+  unsigned int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+  if (bucket >= SC_TELEMETRY_BUCKETS)
+    bucket = SC_TELEMETRY_BUCKETS - 1;
+  __atomic_fetch_add(&slot->hashes, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&slot->hash_ns[bucket], 1, __ATOMIC_RELAXED);
+}
+
+SC_RUNTIME static uint64_t sc_telemetry_start(struct sc_telemetry_slot *slot) {
+  return slot ? sc_now_ns() : 0;
+}
+
+/*
+ * Guard profiling, compiled in with -DSC_PROFILE (link with -ldl and
+ * -rdynamic for symbol names). Every guard call is counted per call site and
+ * region with the bytes it hashed and the time it took, in rdtsc cycles on
+ * x86 and nanoseconds elsewhere. Each thread counts into its own slab, an
+ * open addressing table only that thread writes, so guards never contend.
+ * At exit the slabs are merged by checker (the function around the call
+ * site) and checkee (the region) and written as JSON to SC_PROFILE_OUT
+ * (sc_profile.json by default), keyed "checker/checkee". Names are the ones
+ * of the patch guide: the patcher's dump (SC_PROFILE_GUIDE, patch_guide by
+ * default) maps every checkee's address range to its guide name, which also
+ * covers static functions. Addresses outside of it are named by dladdr, which
+ * only sees exported symbols, and printed in hex otherwise. Slabs of threads
+ * that are still running are read as they are.
+ *
+ * With SC_ASYNC the hashing happens on the verifier thread, outside of any
+ * guard call, and only the cost of queueing is attributed to the guards.
+ */
+#ifdef SC_PROFILE
+#define SC_PROFILE_SLOTS 2048
+
+struct sc_profile_entry {
+  uintptr_t site; // return address of the guard call, 0 marks an empty slot
+  unsigned int address;
+  unsigned int pad;
+  uint64_t calls;
+  uint64_t bytes;
+  uint64_t ticks;
+};
+
+struct sc_profile_slab {
+  struct sc_profile_slab *next;
+  struct sc_profile_entry overflow; // calls that found the slab full
+  struct sc_profile_entry entries[SC_PROFILE_SLOTS];
+};
+
+static struct sc_profile_slab *sc_profile_slabs;
+static pthread_once_t sc_profile_once = PTHREAD_ONCE_INIT;
+static __thread struct sc_profile_slab *sc_profile_slab;
+static __thread uint64_t sc_profile_hashed; // bytes hashed by this thread
+static __thread unsigned int sc_profile_depth;
+
+struct sc_profile_scope {
+  struct sc_profile_entry *entry;
+  uint64_t hashed;
+  uint64_t start;
+};
+
+SC_RUNTIME static uint64_t sc_profile_ticks(void) {
+#ifdef SC_X86
+  return __rdtsc();
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+static void sc_profile_dump(void);
+
+SC_RUNTIME static void sc_profile_init(void) { atexit(sc_profile_dump); }
+
+SC_RUNTIME static struct sc_profile_entry *sc_profile_lookup(uintptr_t site,
+                                                  unsigned int address) {
+  struct sc_profile_slab *slab = sc_profile_slab;
+  if (!slab) {
+    pthread_once(&sc_profile_once, sc_profile_init);
+    slab = calloc(1, sizeof(*slab));
+    if (!slab)
+      return NULL;
+    slab->next = __atomic_load_n(&sc_profile_slabs, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&sc_profile_slabs, &slab->next, slab,
+                                        1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+    sc_profile_slab = slab;
+  }
+  uint64_t key = ((uint64_t) site ^ ((uint64_t) address << 17)) * SC_MIX64_P1;
+  unsigned int i = (unsigned int) (key >> 40), probe;
+  for (probe = 0; probe < SC_PROFILE_SLOTS; ++probe, ++i) {
+    struct sc_profile_entry *entry = &slab->entries[i & (SC_PROFILE_SLOTS - 1)];
+    if (entry->site == site && entry->address == address)
+      return entry;
+    if (!entry->site) {
+      entry->address = address;
+      __atomic_store_n(&entry->site, site, __ATOMIC_RELEASE);
+      return entry;
+    }
+  }
+  return &slab->overflow;
+}
+
+SC_RUNTIME static void sc_profile_begin(struct sc_profile_scope *scope, void *site,
+                             unsigned int address) {
+  scope->entry = sc_profile_lookup((uintptr_t) site, address);
+  scope->hashed = sc_profile_hashed;
+  ++sc_profile_depth;
+  scope->start = sc_profile_ticks();
+}
+
+SC_RUNTIME static void sc_profile_end(struct sc_profile_scope *scope) {
+  uint64_t ticks = sc_profile_ticks() - scope->start;
+  --sc_profile_depth;
+  struct sc_profile_entry *entry = scope->entry;
+  if (!entry)
+    return;
+  __atomic_store_n(&entry->calls, entry->calls + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&entry->bytes,
+                   entry->bytes + sc_profile_hashed - scope->hashed,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&entry->ticks, entry->ticks + ticks, __ATOMIC_RELAXED);
+}
+
+// merge key: start of the checker function and the region
+struct sc_profile_row {
+  uintptr_t checker;
+  uintptr_t site;
+  unsigned int address;
+  uint64_t calls;
+  uint64_t bytes;
+  uint64_t ticks;
+};
+
+SC_RUNTIME static int sc_profile_row_cmp(const void *a, const void *b) {
+  const struct sc_profile_row *x = a, *y = b;
+  if (x->checker != y->checker)
+    return x->checker < y->checker ? -1 : 1;
+  if (x->address != y->address)
+    return x->address < y->address ? -1 : 1;
+  return 0;
+}
+
+// checkee of the patch guide
+struct sc_profile_symbol {
+  uintptr_t address;
+  uintptr_t size;
+  char *name;
+};
+
+static struct sc_profile_symbol *sc_profile_symbols;
+static size_t sc_profile_symbol_count;
+
+SC_RUNTIME static int sc_profile_symbol_cmp(const void *a, const void *b) {
+  const struct sc_profile_symbol *x = a, *y = b;
+  if (x->address != y->address)
+    return x->address < y->address ? -1 : 1;
+  return 0;
+}
+
+// Value of "key": in the JSON object text [begin, end), NULL if absent
+SC_RUNTIME static const char *sc_profile_field(const char *begin, const char *end,
+                                    const char *key) {
+  size_t length = strlen(key);
+  const char *p;
+  for (p = begin; p + length + 2 < end; ++p) {
+    if (*p == '"' && !strncmp(p + 1, key, length) && p[length + 1] == '"') {
+      p += length + 2;
+      while (p < end && (*p == ' ' || *p == ':'))
+        ++p;
+      return p < end ? p : NULL;
+    }
+  }
+  return NULL;
+}
+
+// Reads the patcher's dump, a JSON array of flat objects with the guide
+// name, address and size of every guarded checkee
+SC_RUNTIME static void sc_profile_load_guide(void) {
+  const char *path = getenv("SC_PROFILE_GUIDE");
+  FILE *in = fopen(path && *path ? path : "patch_guide", "r");
+  if (!in)
+    return;
+  size_t size = 0, capacity = 4096, count = 0;
+  char *text = malloc(capacity);
+  size_t n;
+  while (text && (n = fread(text + size, 1, capacity - size - 1, in)) > 0) {
+    size += n;
+    if (size + 1 == capacity) {
+      char *grown = realloc(text, capacity * 2);
+      if (!grown) {
+        free(text);
+        text = NULL;
+        break;
+      }
+      text = grown;
+      capacity *= 2;
+    }
+  }
+  fclose(in);
+  if (!text)
+    return;
+  text[size] = '\0';
+
+  const char *object = text, *end;
+  for (; (object = strchr(object, '{')) && (end = strchr(object, '}'));
+       object = end) {
+    const char *address = sc_profile_field(object, end, "add_target");
+    const char *length = sc_profile_field(object, end, "size_target");
+    const char *name = sc_profile_field(object, end, "function");
+    if (!address || !name || *name != '"')
+      continue;
+    const char *close = strchr(++name, '"');
+    if (!close || close > end)
+      continue;
+    struct sc_profile_symbol *grown = realloc(
+        sc_profile_symbols, (count + 1) * sizeof(*sc_profile_symbols));
+    if (!grown)
+      break;
+    sc_profile_symbols = grown;
+    grown[count].address = (uintptr_t) strtoull(address, NULL, 10);
+    grown[count].size = length ? (uintptr_t) strtoull(length, NULL, 10) : 0;
+    grown[count].name = strndup(name, (size_t) (close - name));
+    if (grown[count].name)
+      ++count;
   }
-//	printf("\n");
+  free(text);
+  qsort(sc_profile_symbols, count, sizeof(*sc_profile_symbols),
+        sc_profile_symbol_cmp);
+  sc_profile_symbol_count = count;
+}
+
+// Guide checkee whose range holds address, NULL if there is none
+SC_RUNTIME static const struct sc_profile_symbol *sc_profile_symbol_at(uintptr_t address) {
+  size_t low = 0, high = sc_profile_symbol_count;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (sc_profile_symbols[middle].address <= address)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  if (!low)
+    return NULL;
+  const struct sc_profile_symbol *symbol = &sc_profile_symbols[low - 1];
+  if (address == symbol->address || address - symbol->address < symbol->size)
+    return symbol;
+  return NULL;
+}
+
+// Start of the function around address, for merging call sites
+SC_RUNTIME static uintptr_t sc_profile_function_start(uintptr_t address) {
+  const struct sc_profile_symbol *symbol = sc_profile_symbol_at(address);
+  if (symbol)
+    return symbol->address;
+  Dl_info info;
+  if (address && dladdr((void *) address, &info) && info.dli_saddr)
+    return (uintptr_t) info.dli_saddr;
+  return address;
+}
+
+SC_RUNTIME static void sc_profile_name(FILE *out, uintptr_t address) {
+  const struct sc_profile_symbol *symbol = sc_profile_symbol_at(address);
+  const char *name = symbol ? symbol->name : NULL;
+  Dl_info info;
+  if (!name && address && dladdr((void *) address, &info))
+    name = info.dli_sname;
+  if (name) {
+    const char *c;
+    for (c = name; *c; ++c) {
+      if (*c == '"' || *c == '\\' || *c == '/')
+        fputc('_', out);
+      else
+        fputc(*c, out);
+    }
+  } else {
+    fprintf(out, "0x%lx", (unsigned long) address);
+  }
+}
+
+SC_RUNTIME static void sc_profile_dump(void) {
+  sc_profile_load_guide();
+  size_t rows = 0, capacity = 0, i;
+  struct sc_profile_row *row = NULL;
+  struct sc_profile_slab *slab;
+  for (slab = __atomic_load_n(&sc_profile_slabs, __ATOMIC_ACQUIRE); slab;
+       slab = slab->next) {
+    capacity += SC_PROFILE_SLOTS + 1;
+  }
+  row = calloc(capacity ? capacity : 1, sizeof(*row));
+  if (!row)
+    return;
+  for (slab = __atomic_load_n(&sc_profile_slabs, __ATOMIC_ACQUIRE); slab;
+       slab = slab->next) {
+    for (i = 0; i <= SC_PROFILE_SLOTS; ++i) {
+      struct sc_profile_entry *entry =
+          i < SC_PROFILE_SLOTS ? &slab->entries[i] : &slab->overflow;
+      uintptr_t site = __atomic_load_n(&entry->site, __ATOMIC_ACQUIRE);
+      uint64_t calls = __atomic_load_n(&entry->calls, __ATOMIC_RELAXED);
+      if (!calls)
+        continue;
+      row[rows].checker = sc_profile_function_start(site);
+      row[rows].site = site;
+      row[rows].address = entry->address;
+      row[rows].calls = calls;
+      row[rows].bytes = __atomic_load_n(&entry->bytes, __ATOMIC_RELAXED);
+      row[rows].ticks = __atomic_load_n(&entry->ticks, __ATOMIC_RELAXED);
+      ++rows;
+    }
+  }
+  qsort(row, rows, sizeof(*row), sc_profile_row_cmp);
+
+  const char *path = getenv("SC_PROFILE_OUT");
+  FILE *out = fopen(path && *path ? path : "sc_profile.json", "w");
+  if (!out) {
+    free(row);
+    return;
+  }
+#ifdef SC_X86
+  fprintf(out, "{\n    \"clock\": \"rdtsc\",\n    \"guards\": {");
+#else
+  fprintf(out, "{\n    \"clock\": \"ns\",\n    \"guards\": {");
+#endif
+  const char *separator = "\n";
+  for (i = 0; i < rows;) {
+    struct sc_profile_row sum = row[i];
+    for (++i; i < rows && !sc_profile_row_cmp(&sum, &row[i]); ++i) {
+      sum.calls += row[i].calls;
+      sum.bytes += row[i].bytes;
+      sum.ticks += row[i].ticks;
+    }
+    fprintf(out, "%s        \"", separator);
+    sc_profile_name(out, sum.site);
+    fputc('/', out);
+    sc_profile_name(out, sum.address);
+    fprintf(out,
+            "\": {\"calls\": %llu, \"bytes\": %llu, \"ticks\": %llu}",
+            (unsigned long long) sum.calls, (unsigned long long) sum.bytes,
+            (unsigned long long) sum.ticks);
+    separator = ",\n";
+  }
+  fprintf(out, "%s}\n}\n", rows ? "\n    " : "");
+  fclose(out);
+  free(row);
+}
+
+#define SC_PROFILE_BEGIN(address)                                              \
+  struct sc_profile_scope sc_scope;                                            \
+  sc_profile_begin(&sc_scope, __builtin_return_address(0), (address))
+#define SC_PROFILE_END() sc_profile_end(&sc_scope)
+#define SC_PROFILE_HASHED(length)                                              \
+  do {                                                                         \
+    if (sc_profile_depth)                                                      \
+      sc_profile_hashed += (length);                                           \
+  } while (0)
+#else
+#define SC_PROFILE_BEGIN(address) (void) 0
+#define SC_PROFILE_END() (void) 0
+#define SC_PROFILE_HASHED(length) (void) 0
+#endif
+
+SC_RUNTIME static void sc_verify_region(enum sc_hash_kind kind, const unsigned int address,
+                             const unsigned int length,
+                             const unsigned int expectedHash,
+                             struct sc_telemetry_slot *slot) {
+  const struct sc_config *config = sc_get_config();
+  uint32_t tag = 0, epoch = 0;
+  if (config->cache_interval_ms) {
+    tag = sc_region_tag(kind, address, length, expectedHash);
+    epoch = sc_cache_epoch(config->cache_interval_ms);
+    if (sc_cache_verified(tag, epoch)) {
+      sc_telemetry_cache_hit(slot);
+      return;
+    }
+  }
+
+  const unsigned char *beginAddress = (const unsigned char *) (uintptr_t) address;
+  //Note: Length is the number of bytes of the checkee, the kernels read it
+  //in wider units but never past beginAddress + length (see #3)
+//	printf("%sLength:%d Begin address:%d Expectedhash:%d\n",KRED,length,address,expectedHash);
+  uint64_t start_ns = sc_telemetry_start(slot);
+  uint32_t hash = sc_hash(kind, beginAddress, length);
+  sc_telemetry_hash(slot, start_ns);
+  SC_PROFILE_HASHED(length);
 
 //	printf("%sruntime hash: %x\n",KGRN,hash);
 //	printf("%sexpected hash: %x\n",KBLU,expectedHash);
 //	printf("%s",KNRM);
 
-  if (hash != (unsigned char) expectedHash) {
-    //response();
-    printf("%sTampered binary!\n", KNRM);
+  if (!sc_hash_matches(kind, hash, expectedHash)) {
+    sc_response();
+  }
+  if (config->cache_interval_ms)
+    sc_cache_mark_verified(tag, epoch);
+}
+
+/*
+ * Asynchronous verification (SC_ASYNC=1). Guards push their request into a
+ * bounded multi-producer ring (Vyukov's queue, every cell carries a sequence
+ * number) and return; a single verifier thread pops the requests, hashes the
+ * regions and triggers the response. A guard on the hot path then costs a
+ * CAS and five stores.
+ */
+struct sc_request {
+  unsigned int address;
+  unsigned int length;
+  unsigned int expected;
+  unsigned int kind;
+  struct sc_telemetry_slot *slot;
+};
+
+struct sc_cell {
+  uint64_t seq;
+  struct sc_request request;
+};
+
+struct sc_ring {
+  struct sc_cell *cells;
+  uint64_t mask;
+  char pad0[64 - sizeof(struct sc_cell *) - sizeof(uint64_t)];
+  uint64_t enqueue_pos; // shared by the producers
+  char pad1[64 - sizeof(uint64_t)];
+  uint64_t dequeue_pos; // owned by the verifier
+  char pad2[64 - sizeof(uint64_t)];
+  uint64_t dropped;
+};
+
+static struct sc_ring sc_ring;
+static pthread_once_t sc_async_once = PTHREAD_ONCE_INIT;
+static int sc_async_ready;
+
+// coalesce: tags of the regions currently waiting in the ring
+static uint32_t sc_pending[SC_CACHE_SLOTS];
 
-    void *callstack[128];
-    int i, frames = backtrace(callstack, 128);
-    char **strs = backtrace_symbols(callstack, frames);
+// An idle verifier parks on sc_verifier_wake after a short spin, producers
+// only take the lock when sc_verifier_parked says it sleeps
+static pthread_mutex_t sc_verifier_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sc_verifier_wake = PTHREAD_COND_INITIALIZER;
+static int sc_verifier_parked;
 
-    for (i = 0; i < frames; ++i) {
-      printf("%s\n", strs[i]);
+SC_RUNTIME static int sc_ring_push(struct sc_ring *ring, const struct sc_request *request) {
+  uint64_t pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+  for (;;) {
+    struct sc_cell *cell = &ring->cells[pos & ring->mask];
+    uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    int64_t diff = (int64_t) seq - (int64_t) pos;
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ring->enqueue_pos, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        cell->request = *request;
+        __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+        return 1;
+      }
+    } else if (diff < 0) {
+      return 0; // full
+    } else {
+      pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
     }
+  }
+}
+
+SC_RUNTIME static int sc_ring_pop(struct sc_ring *ring, struct sc_request *request) {
+  uint64_t pos = ring->dequeue_pos;
+  struct sc_cell *cell = &ring->cells[pos & ring->mask];
+  uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+  if ((int64_t) seq - (int64_t) (pos + 1) < 0)
+    return 0; // empty
+  *request = cell->request;
+  __atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+  ring->dequeue_pos = pos + 1;
+  return 1;
+}
+
+SC_RUNTIME static int sc_ring_empty(struct sc_ring *ring) {
+  struct sc_cell *cell = &ring->cells[ring->dequeue_pos & ring->mask];
+  uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+  return (int64_t) seq - (int64_t) (ring->dequeue_pos + 1) < 0;
+}
+
+/*
+ * The verifier announces that it parks before it looks at the ring a last
+ * time, a producer pushes before it looks at the announcement. With a full
+ * fence on both sides either the verifier sees the request or the producer
+ * sees the verifier parked and wakes it.
+ */
+SC_RUNTIME static void sc_verifier_park(void) {
+  pthread_mutex_lock(&sc_verifier_lock);
+  __atomic_store_n(&sc_verifier_parked, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&sc_verifier_parked, __ATOMIC_RELAXED) &&
+         sc_ring_empty(&sc_ring))
+    pthread_cond_wait(&sc_verifier_wake, &sc_verifier_lock);
+  __atomic_store_n(&sc_verifier_parked, 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&sc_verifier_lock);
+}
+
+SC_RUNTIME static void sc_verifier_notify(void) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&sc_verifier_parked, __ATOMIC_RELAXED))
+    return;
+  pthread_mutex_lock(&sc_verifier_lock);
+  __atomic_store_n(&sc_verifier_parked, 0, __ATOMIC_RELAXED);
+  pthread_cond_signal(&sc_verifier_wake);
+  pthread_mutex_unlock(&sc_verifier_lock);
+}
+
+SC_RUNTIME static void *sc_verifier(void *arg) {
+  const struct sc_config *config = arg;
+  struct sc_request request;
+  unsigned int idle = 0;
+  for (;;) {
+    if (!sc_ring_pop(&sc_ring, &request)) {
+      // spin briefly, then sleep until a producer pushes
+      if (++idle < 64) {
+        sched_yield();
+      } else {
+        sc_verifier_park();
+        idle = 0;
+      }
+      continue;
+    }
+    idle = 0;
+    sc_verify_region((enum sc_hash_kind) request.kind, request.address,
+                     request.length, request.expected, request.slot);
+    if (config->queue_policy == SC_QUEUE_COALESCE) {
+      uint32_t tag = sc_region_tag((enum sc_hash_kind) request.kind,
+                                   request.address, request.length,
+                                   request.expected);
+      __atomic_compare_exchange_n(&sc_pending[tag & (SC_CACHE_SLOTS - 1)],
+                                  &tag, 0, 0, __ATOMIC_RELEASE,
+                                  __ATOMIC_RELAXED);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * The verifier thread does not survive fork(): the child forgets the ring
+ * and starts its own verifier on its first guard call, until then (and if
+ * that fails) it checks synchronously.
+ */
+SC_RUNTIME static void sc_async_atfork_child(void) {
+  free(sc_ring.cells);
+  sc_ring.cells = NULL;
+  sc_ring.enqueue_pos = 0;
+  sc_ring.dequeue_pos = 0;
+  sc_ring.dropped = 0;
+  memset(sc_pending, 0, sizeof(sc_pending));
+  // the parent's verifier may have held the lock at fork()
+  sc_verifier_lock = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+  sc_verifier_wake = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+  sc_verifier_parked = 0;
+  __atomic_store_n(&sc_async_ready, 0, __ATOMIC_RELAXED);
+  sc_async_once = (pthread_once_t) PTHREAD_ONCE_INIT;
+}
+
+SC_RUNTIME static void sc_start_verifier(void) {
+  static int registered;
+  if (!registered) {
+    pthread_atfork(NULL, NULL, sc_async_atfork_child);
+    registered = 1;
+  }
+  const struct sc_config *config = sc_get_config();
+  struct sc_cell *cells = calloc(config->queue_slots, sizeof(struct sc_cell));
+  if (!cells)
+    return;
+  uint64_t i;
+  for (i = 0; i < config->queue_slots; ++i)
+    cells[i].seq = i;
+  sc_ring.cells = cells;
+  sc_ring.mask = config->queue_slots - 1;
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, sc_verifier, (void *) config)) {
+    free(cells);
+    return;
+  }
+  if (config->async_cpu != SC_ASYNC_UNPINNED) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(config->async_cpu, &cpus);
+    pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+  }
+  pthread_detach(thread);
+  __atomic_store_n(&sc_async_ready, 1, __ATOMIC_RELEASE);
+}
+
+SC_RUNTIME static void sc_queue_region(const struct sc_config *config,
+                            enum sc_hash_kind kind, const unsigned int address,
+                            const unsigned int length,
+                            const unsigned int expectedHash,
+                            struct sc_telemetry_slot *slot) {
+  pthread_once(&sc_async_once, sc_start_verifier);
+  if (!__atomic_load_n(&sc_async_ready, __ATOMIC_ACQUIRE)) {
+    // no verifier thread, fail closed by checking on the caller's thread
+    sc_verify_region(kind, address, length, expectedHash, slot);
+    return;
+  }
+
+  uint32_t *pending = NULL;
+  if (config->queue_policy == SC_QUEUE_COALESCE) {
+    uint32_t tag = sc_region_tag(kind, address, length, expectedHash);
+    pending = &sc_pending[tag & (SC_CACHE_SLOTS - 1)];
+    uint32_t expected = 0;
+    if (!__atomic_compare_exchange_n(pending, &expected, tag, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      if (expected == tag)
+        return; // the region is waiting already
+      pending = NULL; // slot taken by another region, queue untracked
+    }
+  }
+
+  struct sc_request request = {address, length, expectedHash,
+                               (unsigned int) kind, slot};
+  while (!sc_ring_push(&sc_ring, &request)) {
+    if (config->queue_policy == SC_QUEUE_BLOCK) {
+      sched_yield();
+      continue;
+    }
+    if (pending)
+      __atomic_store_n(pending, 0, __ATOMIC_RELEASE);
+    if (config->queue_policy == SC_QUEUE_DROP) {
+      __atomic_fetch_add(&sc_ring.dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    // full, fail closed
+    sc_verify_region(kind, address, length, expectedHash, slot);
+    return;
+  }
+  sc_verifier_notify();
+}
 
-    free(strs);
-    exit(777);
+SC_RUNTIME static void sc_check_region(enum sc_hash_kind kind, const unsigned int address,
+                            const unsigned int length,
+                            const unsigned int expectedHash,
+                            struct sc_telemetry_slot *slot) {
+  const struct sc_config *config = sc_get_config();
+  if (config->async)
+    sc_queue_region(config, kind, address, length, expectedHash, slot);
+  else
+    sc_verify_region(kind, address, length, expectedHash, slot);
+}
+
+SC_RUNTIME void guardMe(const unsigned int address, const unsigned int length, const unsigned int expectedHash) {
+  SC_PROFILE_BEGIN(address);
+  struct sc_telemetry_slot *slot =
+      sc_telemetry_call(SC_HASH_XOR, address, length);
+  sc_check_region(SC_HASH_XOR, address, length, expectedHash, slot);
+  SC_PROFILE_END();
+}
+
+SC_RUNTIME void guardMeCRC32C(const unsigned int address, const unsigned int length,
+                   const unsigned int expectedHash) {
+  SC_PROFILE_BEGIN(address);
+  struct sc_telemetry_slot *slot =
+      sc_telemetry_call(SC_HASH_CRC32C, address, length);
+  sc_check_region(SC_HASH_CRC32C, address, length, expectedHash, slot);
+  SC_PROFILE_END();
+}
+
+SC_RUNTIME void guardMeAdler32(const unsigned int address, const unsigned int length,
+                    const unsigned int expectedHash) {
+  SC_PROFILE_BEGIN(address);
+  struct sc_telemetry_slot *slot =
+      sc_telemetry_call(SC_HASH_ADLER32, address, length);
+  sc_check_region(SC_HASH_ADLER32, address, length, expectedHash, slot);
+  SC_PROFILE_END();
+}
+
+SC_RUNTIME void guardMeMix64(const unsigned int address, const unsigned int length,
+                  const unsigned int expectedHash) {
+  SC_PROFILE_BEGIN(address);
+  struct sc_telemetry_slot *slot =
+      sc_telemetry_call(SC_HASH_MIX64, address, length);
+  sc_check_region(SC_HASH_MIX64, address, length, expectedHash, slot);
+  SC_PROFILE_END();
+}
+
+/*
+ * Table guards (-sc-guard-table). SCPass emits sc_guard_table, the patcher
+ * fills in address, length and hash of every descriptor, and each guard is a
+ * single guardMeIdx(id) call. The layout must match emitGuardTable in SC.cpp
+ * and GUARD_DESC_SIZE in patcher/dump_pipe.py.
+ */
+struct sc_guard_desc {
+  unsigned int address;
+  unsigned int length;
+  unsigned int hash;
+  unsigned int algorithm; // enum sc_hash_kind
+  unsigned int every;     // hash on every N-th call, 0 and 1 hash every call
+  unsigned int interval_us; // at most one hash per window, 0 disables
+  unsigned int chunk_bytes; // bytes hashed per call, 0 hashes the whole region
+};
+
+// weak: modules protected without -sc-guard-table have no table. Not const,
+// the patcher rewrites the table in the binary after the loads are compiled
+extern struct sc_guard_desc sc_guard_table[] __attribute__((weak));
+extern const unsigned int sc_guard_count __attribute__((weak));
+
+/*
+ * Rate limiting (-sc-check-every, -sc-check-interval-us) and chunked hashing
+ * (-sc-chunk-bytes). The per-guard counters live in writable memory next to
+ * the read-only table, allocated on the first call that needs them. The first
+ * call of a rate-limited guard is always checked.
+ */
+struct sc_guard_state {
+  unsigned int calls;
+  unsigned int busy; // held while a chunk is hashed
+  uint64_t last_check_us;
+  unsigned int offset; // bytes of the region hashed so far
+  unsigned int pad;
+  uint64_t hash_state;
+};
+
+static struct sc_guard_state *sc_guard_states;
+
+SC_RUNTIME static struct sc_guard_state *sc_get_guard_states(void) {
+  struct sc_guard_state *states =
+      __atomic_load_n(&sc_guard_states, __ATOMIC_ACQUIRE);
+  if (states || !&sc_guard_count)
+    return states;
+  struct sc_guard_state *fresh =
+      calloc(sc_guard_count, sizeof(struct sc_guard_state));
+  if (!fresh)
+    return NULL;
+  if (!__atomic_compare_exchange_n(&sc_guard_states, &states, fresh, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    free(fresh); // another thread published first
+    return states;
+  }
+  return fresh;
+}
+
+SC_RUNTIME static int sc_guard_due(const struct sc_guard_desc *desc, unsigned int id) {
+  if (desc->every <= 1 && !desc->interval_us)
+    return 1;
+  struct sc_guard_state *states = sc_get_guard_states();
+  if (!states || id >= sc_guard_count)
+    return 1; // fail closed
+  struct sc_guard_state *state = &states[id];
+  if (desc->every > 1) {
+    unsigned int call = __atomic_fetch_add(&state->calls, 1, __ATOMIC_RELAXED);
+    if (call % desc->every)
+      return 0;
+  }
+  if (desc->interval_us) {
+    uint64_t now = sc_now_us();
+    uint64_t last = __atomic_load_n(&state->last_check_us, __ATOMIC_RELAXED);
+    if (last && now - last < desc->interval_us)
+      return 0;
+    // only the thread that moves the window forward checks
+    if (!__atomic_compare_exchange_n(&state->last_check_us, &last, now, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return 0;
+  }
+  return 1;
+}
+
+/*
+ * A chunked guard hashes the next chunk_bytes of its region per call and
+ * compares once the whole region was covered, so the expected hash is the one
+ * of the full region. Chunks are whole 8-byte words, which keeps the Mix64
+ * tail in the last update. Calls that find another thread advancing the same
+ * guard return without hashing.
+ */
+SC_RUNTIME static void sc_check_chunk(const struct sc_guard_desc *desc, unsigned int id,
+                           struct sc_telemetry_slot *slot) {
+  struct sc_guard_state *states = sc_get_guard_states();
+  if (!states || id >= sc_guard_count) {
+    sc_check_region((enum sc_hash_kind) desc->algorithm, desc->address,
+                    desc->length, desc->hash, slot);
+    return;
+  }
+  struct sc_guard_state *state = &states[id];
+  if (__atomic_exchange_n(&state->busy, 1, __ATOMIC_ACQUIRE))
+    return;
+
+  enum sc_hash_kind kind = (enum sc_hash_kind) desc->algorithm;
+  unsigned int chunk = (desc->chunk_bytes + 7) & ~7u;
+  if (state->offset == 0)
+    state->hash_state = sc_hash_init(kind);
+  unsigned int remaining = desc->length - state->offset;
+  if (chunk > remaining)
+    chunk = remaining;
+  const unsigned char *p =
+      (const unsigned char *) (uintptr_t) desc->address + state->offset;
+  uint64_t start_ns = sc_telemetry_start(slot);
+  state->hash_state = sc_hash_update(kind, state->hash_state, p, chunk);
+  sc_telemetry_hash(slot, start_ns);
+  SC_PROFILE_HASHED(chunk);
+  state->offset += chunk;
+  if (state->offset == desc->length) {
+    uint32_t hash = sc_hash_final(kind, state->hash_state, desc->length);
+    state->offset = 0;
+    if (!sc_hash_matches(kind, hash, desc->hash))
+      sc_response();
+  }
+  __atomic_store_n(&state->busy, 0, __ATOMIC_RELEASE);
+}
+
+SC_RUNTIME static void sc_run_guard(const struct sc_guard_desc *desc, unsigned int id) {
+  struct sc_telemetry_slot *slot = sc_telemetry_call(
+      (enum sc_hash_kind) desc->algorithm, desc->address, desc->length);
+  if (!sc_guard_due(desc, id))
+    return;
+  if (desc->chunk_bytes && desc->chunk_bytes < desc->length)
+    sc_check_chunk(desc, id, slot);
+  else
+    sc_check_region((enum sc_hash_kind) desc->algorithm, desc->address,
+                    desc->length, desc->hash, slot);
+}
+
+SC_RUNTIME void guardMeIdx(const unsigned int id) {
+  SC_PROFILE_BEGIN(sc_guard_table[id].address);
+  sc_run_guard(&sc_guard_table[id], id);
+  SC_PROFILE_END();
+}
+
+/*
+ * Batched guards (-sc-batch-guards): descs is the checker's slice of
+ * sc_guard_table. The regions are checked in address order so that the
+ * hashing streams forward through the text section, and the next region is
+ * prefetched while the current one is hashed.
+ */
+#define SC_BATCH_SLICE 64
+
+SC_RUNTIME void guardMeBatch(const struct sc_guard_desc *descs, const unsigned int count) {
+  unsigned int order[SC_BATCH_SLICE];
+  unsigned int base, i, j, n;
+  for (base = 0; base < count; base += n) {
+    n = count - base < SC_BATCH_SLICE ? count - base : SC_BATCH_SLICE;
+    // insertion sort, batches are as small as the connectivity of the network
+    for (i = 0; i < n; ++i) {
+      unsigned int idx = base + i;
+      for (j = i; j > 0 && descs[order[j - 1]].address > descs[idx].address; --j)
+        order[j] = order[j - 1];
+      order[j] = idx;
+    }
+    for (i = 0; i < n; ++i) {
+      const struct sc_guard_desc *desc = &descs[order[i]];
+      if (i + 1 < n)
+        __builtin_prefetch(
+            (const void *) (uintptr_t) descs[order[i + 1]].address);
+      SC_PROFILE_BEGIN(desc->address);
+      sc_run_guard(desc, (unsigned int) (desc - sc_guard_table));
+      SC_PROFILE_END();
+    }
   }
 }
 
@@ -55,6 +1512,6 @@ void guardMe(const unsigned int address, const unsigned int length, const unsign
 //	printf("adding hash %s %i\n",valueName, i);
 //        hash +=i;
 //}
-void logHash() {
+SC_RUNTIME void logHash() {
   //printf("final hash: %ld\n", hash);
 }
@@ -17,7 +17,7 @@ opt-3.9 -load $INPUT_DEP_PATH/libInputDependency.so -load $UTILS_LIB -load $SC_P
 echo 'Link'
 llvm-link-3.9 out.bc rtlib.bc -o out.bc
 echo 'Binary'
-clang-3.9 out.bc -o out 
+clang-3.9 out.bc -o out -pthread -lrt
 
 echo 'Post patching'
 python patcher/dump_pipe.py out guide.txt patch_guide
@@ -63,7 +63,7 @@ gcc -c -rdynamic out.s -o out.o -lncurses
 gcc -g -rdynamic -c $OH_PATH/assertions/response.c -o response.o
 
 #gcc -g -rdynamic -c rtlib.c -o rtlib.o
-gcc -g -rdynamic out.o response.o -o out -lncurses 
+gcc -g -rdynamic out.o response.o -o out -lncurses -pthread -lrt
 
 #clang++-3.9 -lncurses -rdynamic -std=c++0x out.bc -o out
 python patcher/dump_pipe.py out guide.txt patch_guide
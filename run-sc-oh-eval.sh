@@ -92,7 +92,7 @@ if [ $? -eq 0 ]; then
 
 
 #gcc -g -rdynamic -c rtlib.c -o rtlib.o
-gcc -g -rdynamic out.o response.o -o out -lncurses 
+gcc -g -rdynamic out.o response.o -o out -lncurses -pthread -lrt
 if [ $? -eq 0 ]; then
 	    echo 'OK -g2'
     else
@@ -42,7 +42,7 @@ llvm-link-3.9 out.bc $OH_PATH/assertions/logs.bc -o out.bc
 llvm-link-3.9 out.bc rtlib.bc -o out.bc
 
 echo 'Post patching binary after hash calls'
-clang++-3.9 -lncurses -rdynamic -std=c++0x out.bc -o out
+clang++-3.9 -lncurses -rdynamic -std=c++0x out.bc -o out -pthread -lrt
 python patcher/dump_pipe.py out guide.txt patch_guide
 echo 'Done patching'
 
@@ -56,7 +56,7 @@ opt-3.9 -load $INPUT_DEP_PATH/libInputDependency.so -load $OH_LIB/liboblivious-h
 
 
 #Write binary for hash, address and size computation
-clang++-3.9 -lncurses -rdynamic -std=c++0x out.bc -o out
+clang++-3.9 -lncurses -rdynamic -std=c++0x out.bc -o out -pthread -lrt
 
 
 echo 'Post patching binary after assert calls'
@@ -4,6 +4,7 @@ echo 'program.c input sc-include-func assert-skip-func-file'
 UTILS_LIB=/home/sip/self-checksumming/build/lib/libUtils.so
 INPUT_DEP_PATH=/usr/local/lib/
 SC_PATH=/home/sip/self-checksumming/build/lib
+SC_PATCHER=/home/sip/self-checksumming/build/sc-patcher
 
 
 #------------------ARGS for the script-------------
@@ -31,9 +32,74 @@ fi
 
 #-dump-checkers-network		dump the network in the specified path
 
+#-sc-incremental-cache=PATH	keep the network across builds: sensitive functions
+#				whose IR is unchanged keep their checkers, only new and
+#				changed ones are placed. The guard hashes are still
+#				recomputed by the patcher
+
 #-sensitive-only-checked	sensitive functions are never checkers but checkees, 
 #				extracted only assumes this regardless of the flag  
 
+#-sc-hash=xor|crc32c|adler32|mix64	hash algorithm of the guards, recorded in
+#				guide.txt so that the patcher computes the same hash
+
+#-sc-guard-table		guards become one guardMeIdx(id) call into the
+#				sc_guard_table descriptor table
+
+#-sc-batch-guards		one guardMeBatch call per checker covers all of its
+#				checkees, descriptors are kept in sc_guard_table. Its
+#				manifest protects the checker and carries the
+#				constraints of every checkee
+
+#-sc-max-guard-frequency=F	functions estimated to run more than F times are
+#				never checkers (profile counts when the bitcode was
+#				built with -fprofile-instr-use, static estimates otherwise)
+
+#-sc-cold-placement		insert guards into the coldest block of the checker
+
+#-sc-network-strategy=random|cost	cost picks the checkers with the lowest
+#				call frequency x checkee size
+
+#-sc-max-guards-per-checker=N	guards a checker carries under the cost strategy
+#				before warmer ones are taken, 0 for twice the even share
+
+#-sc-check-every=N		table guards hash their checkees on every N-th call,
+#				implies -sc-guard-table
+
+#-sc-check-interval-us=T	table guards hash at most once per T microseconds,
+#				implies -sc-guard-table
+
+#-sc-rate-limit=checker=N:T	per-checker override of the two options above
+
+#-sc-chunk-bytes=K		table guards hash K bytes of their checkee per call
+#				and compare after covering all of it, implies
+#				-sc-guard-table
+
+#-sc-patch-guide=path		where the patch guide is written (guide.txt), text
+#				entries are appended once when the pass finishes, so
+#				remove the old guide first (done below)
+
+#-sc-patch-guide-format=text|binary	binary writes fixed size records and
+#				replaces the file, both patchers read either format
+
+#runtime environment of the protected binary (see sc_load_config in rtlib.c):
+#SC_ASYNC=1 hashes on a background verifier thread, SC_ASYNC_CPU pins it,
+#SC_QUEUE_SLOTS and SC_QUEUE_POLICY=sync|coalesce|block|drop size its request ring
+#(a full ring is verified synchronously unless the policy is block or drop)
+#SC_TELEMETRY=1 publishes live guard counters, read them with
+#telemetry/build/sc-telemetry <pid> [interval-seconds] (make -C telemetry)
+
+#SC_PROFILE=1 ./run-sc.sh ... builds the runtime with per-guard call, byte and
+#cycle counters, the protected binary writes them to SC_PROFILE_OUT
+#(sc_profile.json) at exit, named after the patcher's dump (SC_PROFILE_GUIDE,
+#patch_guide by default)
+RTLIB_FLAGS=""
+RTLIB_LIBS=""
+if [ "$SC_PROFILE" = "1" ]; then
+	RTLIB_FLAGS="-DSC_PROFILE"
+	RTLIB_LIBS="-ldl"
+fi
+
 #$1 is the .c file for transformation
 echo 'build changes'
 make -C build/
@@ -80,7 +146,7 @@ if [ $? -eq 0 ]; then
 
 
 #link guardMe function
-clang-3.9 rtlib.c -c -emit-llvm -o rtlib.bc
+clang-3.9 $RTLIB_FLAGS rtlib.c -c -emit-llvm -o rtlib.bc
 llvm-link-3.9 out.bc rtlib.bc -o out.bc
 
 
@@ -88,10 +154,15 @@ echo 'Post patching binary after hash calls'
 llc-3.9 out.bc
 gcc -c -rdynamic out.s -o out.o -lncurses
 #gcc -g -rdynamic -c rtlib.c -o rtlib.o
-gcc -g -rdynamic out.o response.o -o out -lncurses 
+gcc -g -rdynamic out.o response.o -o out -lncurses -pthread -lrt $RTLIB_LIBS
 
 #clang++-3.9 -lncurses -rdynamic -std=c++0x out.bc -o out
-python patcher/dump_pipe.py out guide.txt patch_guide
+# sc-patcher is the native patcher, same arguments and outputs as dump_pipe.py
+if [ -x $SC_PATCHER ]; then
+	$SC_PATCHER out guide.txt patch_guide
+else
+	python patcher/dump_pipe.py out guide.txt patch_guide
+fi
 echo 'Done patching'
 
 chmod +x out
@@ -0,0 +1,95 @@
+#include "self-checksumming/CallFrequency.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+bool hasDirectCaller(const Function &F) {
+  for (const auto *user : F.users()) {
+    ImmutableCallSite CS(user);
+    if (CS && CS.getCalledFunction() == &F) {
+      return true;
+    }
+  }
+  return false;
+}
+} // namespace
+
+void CallFrequency::compute(Module &M, const BFIGetter &getBFI) {
+  frequency.clear();
+  profile = false;
+  for (auto &F : M) {
+    if (!F.isDeclaration() && F.getEntryCount().hasValue()) {
+      profile = true;
+      break;
+    }
+  }
+
+  if (profile) {
+    for (auto &F : M) {
+      if (F.isDeclaration())
+        continue;
+      auto count = F.getEntryCount();
+      frequency[&F] =
+          count.hasValue() ? static_cast<double>(count.getCount()) : 0.0;
+    }
+    dbgs() << "CallFrequency: using profile entry counts\n";
+    return;
+  }
+
+  for (auto &F : M) {
+    if (F.isDeclaration())
+      continue;
+    frequency[&F] =
+        (F.getName() == "main" || !hasDirectCaller(F)) ? 1.0 : 0.0;
+  }
+
+  // scc_iterator visits callees before callers, walk it backwards so that
+  // the frequency of a caller is final before it is pushed to its callees.
+  // Recursive calls inside an SCC are only counted once.
+  CallGraph CG(M);
+  std::vector<std::vector<CallGraphNode *>> sccs;
+  for (auto it = scc_begin(&CG); !it.isAtEnd(); ++it) {
+    sccs.push_back(*it);
+  }
+  for (auto scc = sccs.rbegin(); scc != sccs.rend(); ++scc) {
+    for (auto *node : *scc) {
+      Function *F = node->getFunction();
+      if (!F || F->isDeclaration())
+        continue;
+      const double callerFrequency = frequency[F];
+      if (callerFrequency == 0.0)
+        continue;
+      auto &BFI = getBFI(*F);
+      const double entryFrequency = static_cast<double>(BFI.getEntryFreq());
+      for (auto &BB : *F) {
+        const double blockFrequency =
+            static_cast<double>(BFI.getBlockFreq(&BB).getFrequency()) /
+            entryFrequency;
+        for (auto &I : BB) {
+          CallSite CS(&I);
+          if (!CS)
+            continue;
+          Function *callee = CS.getCalledFunction();
+          if (!callee || callee->isDeclaration())
+            continue;
+          frequency[callee] += callerFrequency * blockFrequency;
+        }
+      }
+    }
+  }
+  dbgs() << "CallFrequency: using static block frequency estimates\n";
+}
+
+double CallFrequency::getFrequency(const Function *F) const {
+  auto it = frequency.find(F);
+  return it == frequency.end() ? 0.0 : it->second;
+}
@@ -0,0 +1,51 @@
+#include "self-checksumming/CheckerGraph.h"
+
+using namespace llvm;
+
+CheckerGraph::NodeId CheckerGraph::Builder::addNode(Function *F) {
+  auto inserted = ids.insert({F, static_cast<NodeId>(nodes.size())});
+  if (inserted.second)
+    nodes.push_back(F);
+  return inserted.first->second;
+}
+
+void CheckerGraph::Builder::addEdge(Function *checker, Function *checkee) {
+  NodeId from = addNode(checker);
+  NodeId to = addNode(checkee);
+  edges.push_back({from, to});
+}
+
+// Counting sort of the edges by source, stable so that the order in which
+// the edges were added survives in each row
+static void buildRows(size_t numNodes,
+                      const std::vector<std::pair<CheckerGraph::NodeId,
+                                                  CheckerGraph::NodeId>> &edges,
+                      bool reverse, std::vector<uint32_t> &offsets,
+                      std::vector<CheckerGraph::NodeId> &targets) {
+  offsets.assign(numNodes + 1, 0);
+  for (auto &edge : edges)
+    ++offsets[(reverse ? edge.second : edge.first) + 1];
+  for (size_t i = 0; i < numNodes; ++i)
+    offsets[i + 1] += offsets[i];
+  targets.resize(edges.size());
+  std::vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+  for (auto &edge : edges) {
+    if (reverse)
+      targets[next[edge.second]++] = edge.first;
+    else
+      targets[next[edge.first]++] = edge.second;
+  }
+}
+
+CheckerGraph CheckerGraph::Builder::build() {
+  CheckerGraph graph;
+  buildRows(nodes.size(), edges, false, graph.checkeeOffsets,
+            graph.checkeeIds);
+  buildRows(nodes.size(), edges, true, graph.checkerOffsets, graph.checkerIds);
+  graph.nodes = std::move(nodes);
+  graph.ids = std::move(ids);
+  nodes.clear();
+  ids.clear();
+  edges.clear();
+  return graph;
+}
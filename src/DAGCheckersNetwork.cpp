@@ -3,6 +3,13 @@
 #include <algorithm>
 #include <iomanip>
 #include <random>
+#include <set>
+#include "llvm/ADT/DenseMap.h"
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using json = nlohmann::json;
 
@@ -17,215 +24,648 @@ void DAGCheckersNetwork::setLowerConnectivityAcceptance(bool value) {
   this->accept_lower_connectivity = value;
 }
 
-std::map<Function *, std::vector<Function *>>
-DAGCheckersNetwork::loadJson(std::string filePath, llvm::Module &module,
-                             std::list<Function *> &reverseTopologicalSort) {
+void DAGCheckersNetwork::setNetworkEcho(bool value) {
+  this->echo_network = value;
+}
+
+void DAGCheckersNetwork::setStrategy(Strategy value) {
+  this->strategy = value;
+}
+
+void DAGCheckersNetwork::setMaxGuardsPerChecker(size_t value) {
+  this->maxGuardsPerChecker = value;
+}
+
+void DAGCheckersNetwork::setPinnedCheckers(
+    std::map<Function *, std::vector<Function *>> checkers) {
+  this->pinnedCheckers = std::move(checkers);
+}
+
+const std::vector<Function *> &DAGCheckersNetwork::getCheckeeOrder() const {
+  return checkeeOrder;
+}
+
+void DAGCheckersNetwork::setCostModel(std::map<Function *, double> frequency,
+                                      std::map<Function *, long> size) {
+  this->checkerFrequency = std::move(frequency);
+  this->checkeeSize = std::move(size);
+}
+
+double DAGCheckersNetwork::frequencyOf(Function *F) const {
+  auto frequency = checkerFrequency.find(F);
+  return frequency == checkerFrequency.end() ? 0 : frequency->second;
+}
+
+double DAGCheckersNetwork::guardCost(Function *checker,
+                                     Function *checkee) const {
+  auto frequency = checkerFrequency.find(checker);
+  auto size = checkeeSize.find(checkee);
+  if (frequency == checkerFrequency.end() || size == checkeeSize.end())
+    return 0;
+  return frequency->second * static_cast<double>(size->second);
+}
+
+namespace {
+// SAX handler of the network JSON: functions are resolved and added to the
+// graph as their names stream by, no DOM of the file is built. Checkees are
+// read from "map", the injection order from "topologicalsort", and
+// "allCheckees" is redundant with the map.
+class NetworkReader {
+public:
+  NetworkReader(Module &module, bool echo) : module(module), echo(echo) {}
+
+  CheckerGraph::Builder builder;
+  std::vector<Function *> order;
+
+  bool null() { return true; }
+  bool boolean(bool) { return true; }
+  bool number_integer(json::number_integer_t) { return true; }
+  bool number_unsigned(json::number_unsigned_t) { return true; }
+  bool number_float(json::number_float_t, const json::string_t &) {
+    return true;
+  }
+  template <typename Binary> bool binary(Binary &) { return true; }
+
+  bool string(json::string_t &name) {
+    if (section == Section::Map && depth == 3) {
+      Function *checkee = resolve(name);
+      if (checker && checkee)
+        builder.addEdge(checker, checkee);
+    } else if (section == Section::Order && depth == 2) {
+      if (echo)
+        std::cout << '"' << name << "\"\n";
+      if (Function *F = resolve(name))
+        order.push_back(F);
+    }
+    return true;
+  }
+  bool key(json::string_t &name) {
+    if (depth == 1) {
+      section = name == "map"               ? Section::Map
+                : name == "topologicalsort" ? Section::Order
+                                            : Section::Other;
+    } else if (section == Section::Map && depth == 2) {
+      checker = resolve(name);
+      if (checker)
+        builder.addNode(checker);
+    }
+    return true;
+  }
+  bool start_object(std::size_t) { return ++depth, true; }
+  bool end_object() { return --depth, true; }
+  bool start_array(std::size_t) { return ++depth, true; }
+  bool end_array() { return --depth, true; }
+  bool parse_error(std::size_t position, const std::string &,
+                   const nlohmann::detail::exception &ex) {
+    dbgs() << "ERR. Malformed CheckersNetwork file at byte " << position
+           << ": " << ex.what() << "\n";
+    return false;
+  }
+
+private:
+  enum class Section { Other, Map, Order };
+
+  Function *resolve(const std::string &name) {
+    Function *F = module.getFunction(name);
+    if (!F)
+      dbgs() << "ERR. CheckersNetwork refers to unknown function " << name
+             << "\n";
+    return F;
+  }
 
-  std::map<Function *, std::vector<Function *>> dump_map;
+  Module &module;
+  bool echo;
+  unsigned depth = 0;
+  Section section = Section::Other;
+  Function *checker = nullptr;
+};
+
+void writeString(std::ostream &out, StringRef value) {
+  out << '"';
+  for (unsigned char c : value) {
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (c < 0x20) {
+      out << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+          << static_cast<unsigned>(c) << std::dec << std::setfill(' ');
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+}
+
+// Writes a JSON array of function names at the given indentation, in the
+// layout nlohmann::json pretty-prints with an indent of 4
+template <typename Range, typename Name>
+void writeNames(std::ostream &out, const Range &range, Name name,
+                unsigned indent) {
+  std::string pad(indent + 4, ' ');
+  const char *separator = "\n";
+  out << '[';
+  for (auto &item : range) {
+    Function *F = name(item);
+    if (!F)
+      continue;
+    out << separator << pad;
+    writeString(out, F->getName());
+    separator = ",\n";
+  }
+  if (*separator == ',')
+    out << '\n' << std::string(indent, ' ');
+  out << ']';
+}
+
+void writeNetwork(std::ostream &out, const CheckerGraph &graph,
+                  const std::vector<CheckerGraph::NodeId> &reverseTopologicalSort) {
+  auto function = [&graph](CheckerGraph::NodeId node) {
+    return graph.function(node);
+  };
+  std::vector<CheckerGraph::NodeId> checkees, checkers;
+  for (CheckerGraph::NodeId node = 0; node < graph.size(); ++node) {
+    if (!graph.function(node)) {
+      dbgs() << "Null found\n";
+      continue;
+    }
+    if (!graph.checkers(node).empty())
+      checkees.push_back(node);
+    if (graph.isChecker(node))
+      checkers.push_back(node);
+  }
+
+  out << "{\n    \"allCheckees\": ";
+  writeNames(out, checkees, function, 4);
+  out << ",\n    \"map\": {";
+  const char *separator = "\n";
+  for (auto checker : checkers) {
+    out << separator << "        ";
+    writeString(out, graph.function(checker)->getName());
+    out << ": ";
+    writeNames(out, graph.checkees(checker), function, 8);
+    separator = ",\n";
+  }
+  out << (checkers.empty() ? "}" : "\n    }");
+  out << ",\n    \"topologicalsort\": ";
+  writeNames(out, reverseTopologicalSort, function, 4);
+  out << "\n}\n";
+}
+} // namespace
+
+CheckerGraph
+DAGCheckersNetwork::loadJson(const std::string &filePath, llvm::Module &module,
+                             std::vector<CheckerGraph::NodeId> &reverseTopologicalSort) {
+  NetworkReader reader(module, echo_network);
   // check if the file exists
   std::ifstream i(filePath);
   if (i.is_open()) {
-    json j;
-    i >> j;
-    for (auto &checker : j["topologicalsort"]) {
-      auto checkerFunc = module.getFunction(checker.get<std::string>());
-      std::vector<Function *> func_checkee;
-      std::cout << checker << "\n";
-      auto &checkees = j["map"][checker.get<std::string>()];
-      for (auto &checkee : checkees) {
-        func_checkee.push_back(module.getFunction(checkee.get<std::string>()));
-      }
-      dump_map[checkerFunc] = func_checkee;
-
-      reverseTopologicalSort.push_back(checkerFunc);
+    // a partial network would leave part of the guards out
+    if (!json::sax_parse(i, &reader)) {
+      errs() << "ERR. Could not parse the CheckersNetwork file " << filePath
+             << "\n";
+      exit(1);
     }
-    // json tsort = j["topologicalsort"];
-    // for(auto& tsort_checker:tsort){
-    // std::cout<<tsort_checker<<"\n";
-    //}
   } else {
     dbgs() << "ERR. Could not open the provided CheckersNetwork file "
            << filePath << "\n";
   }
-  return dump_map;
+  CheckerGraph graph = reader.builder.build();
+  reverseTopologicalSort.clear();
+  for (auto *F : reader.order) {
+    auto node = graph.lookup(F);
+    if (node != CheckerGraph::NoNode)
+      reverseTopologicalSort.push_back(node);
+  }
+  return graph;
 }
 
 void DAGCheckersNetwork::dumpJson(
-    const std::map<Function *, std::vector<Function *>> checkerToCheckee,
-    std::string filePath, const std::list<Function *> reverseTopologicalSort) {
-  // TODO: fix the problem with JSON dumper
-  json j;
-  std::vector<Function *> uniqueCheckees;
-  j["allCheckees"] = json::array();
-  for (const auto& checker : checkerToCheckee) {
-    if (!checker.first) {
-      dbgs() << "Null found\n";
+    const CheckerGraph &graph, const std::string &filePath,
+    const std::vector<CheckerGraph::NodeId> &reverseTopologicalSort) {
+  if (echo_network)
+    writeNetwork(std::cout, graph, reverseTopologicalSort);
+  std::ofstream o(filePath);
+  writeNetwork(o, graph, reverseTopologicalSort);
+}
+
+namespace {
+const char NetworkMagic[4] = {'S', 'C', 'N', '1'};
+// node count, edge count, order length, name bytes
+const size_t NetworkHeaderWords = 4;
+
+// Read-only mapping of a whole file
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      if (fd >= 0)
+        close(fd);
+      return;
+    }
+    size = static_cast<size_t>(st.st_size);
+    void *mapping = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                         : MAP_FAILED;
+    close(fd);
+    if (mapping != MAP_FAILED)
+      data = static_cast<const char *>(mapping);
+  }
+  ~MappedFile() {
+    if (data)
+      munmap(const_cast<char *>(data), size);
+  }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *data = nullptr;
+  size_t size = 0;
+};
+
+bool isMonotonic(const uint32_t *offsets, size_t count, uint32_t limit) {
+  if (offsets[0] != 0)
+    return false;
+  for (size_t i = 0; i < count; ++i) {
+    if (offsets[i] > offsets[i + 1])
+      return false;
+  }
+  return offsets[count] == limit;
+}
+} // namespace
+
+bool DAGCheckersNetwork::isBinaryNetwork(const std::string &filePath) {
+  char magic[sizeof(NetworkMagic)] = {};
+  std::ifstream stream(filePath, std::ifstream::binary);
+  stream.read(magic, sizeof(magic));
+  return stream.gcount() == sizeof(magic) &&
+         !memcmp(magic, NetworkMagic, sizeof(magic));
+}
+
+void DAGCheckersNetwork::dumpBinary(
+    const CheckerGraph &graph, const std::string &filePath,
+    const std::vector<CheckerGraph::NodeId> &reverseTopologicalSort) {
+  std::string names;
+  std::vector<uint32_t> nameOffsets{0};
+  std::vector<uint32_t> checkeeOffsets{0};
+  std::vector<uint32_t> checkeeIds;
+  checkeeIds.reserve(graph.numEdges());
+  for (CheckerGraph::NodeId node = 0; node < graph.size(); ++node) {
+    if (auto *F = graph.function(node))
+      names += F->getName();
+    nameOffsets.push_back(static_cast<uint32_t>(names.size()));
+    auto checkees = graph.checkees(node);
+    checkeeIds.insert(checkeeIds.end(), checkees.begin(), checkees.end());
+    checkeeOffsets.push_back(static_cast<uint32_t>(checkeeIds.size()));
+  }
+  uint32_t header[NetworkHeaderWords] = {
+      static_cast<uint32_t>(graph.size()),
+      static_cast<uint32_t>(checkeeIds.size()),
+      static_cast<uint32_t>(reverseTopologicalSort.size()),
+      static_cast<uint32_t>(names.size())};
+  auto write = [](std::ofstream &o, const std::vector<uint32_t> &words) {
+    o.write(reinterpret_cast<const char *>(words.data()),
+            words.size() * sizeof(uint32_t));
+  };
+  std::ofstream o(filePath, std::ofstream::binary | std::ofstream::trunc);
+  o.write(NetworkMagic, sizeof(NetworkMagic));
+  o.write(reinterpret_cast<const char *>(header), sizeof(header));
+  write(o, nameOffsets);
+  write(o, checkeeOffsets);
+  write(o, checkeeIds);
+  write(o, reverseTopologicalSort);
+  o.write(names.data(), names.size());
+  if (!o) {
+    errs() << "ERR. Could not write the CheckersNetwork file " << filePath
+           << "\n";
+  }
+  if (echo_network)
+    writeNetwork(std::cout, graph, reverseTopologicalSort);
+}
+
+CheckerGraph DAGCheckersNetwork::loadBinary(
+    const std::string &filePath, llvm::Module &module,
+    std::vector<CheckerGraph::NodeId> &reverseTopologicalSort) {
+  CheckerGraph::Builder builder;
+  reverseTopologicalSort.clear();
+  MappedFile file(filePath);
+  if (!file.data) {
+    dbgs() << "ERR. Could not open the provided CheckersNetwork file "
+           << filePath << "\n";
+    return builder.build();
+  }
+  // all sections but the trailing names are u32 arrays
+  const auto *words =
+      reinterpret_cast<const uint32_t *>(file.data + sizeof(NetworkMagic));
+  // like loadJson, never go on with a partial network
+  auto malformed = [&filePath]() {
+    errs() << "ERR. Malformed CheckersNetwork file " << filePath << "\n";
+    exit(1);
+  };
+  size_t headerBytes =
+      sizeof(NetworkMagic) + sizeof(uint32_t) * NetworkHeaderWords;
+  if (file.size < headerBytes) {
+    malformed();
+  }
+  size_t nodes = words[0], edges = words[1], orderSize = words[2],
+         nameBytes = words[3];
+  if (headerBytes +
+          sizeof(uint32_t) * (2 * (nodes + 1) + edges + orderSize) +
+          nameBytes >
+      file.size) {
+    malformed();
+  }
+  const uint32_t *nameOffsets = words + NetworkHeaderWords;
+  const uint32_t *checkeeOffsets = nameOffsets + nodes + 1;
+  const uint32_t *checkeeIds = checkeeOffsets + nodes + 1;
+  const uint32_t *order = checkeeIds + edges;
+  const char *names = reinterpret_cast<const char *>(order + orderSize);
+  if (!isMonotonic(nameOffsets, nodes, nameBytes) ||
+      !isMonotonic(checkeeOffsets, nodes, edges) ||
+      std::any_of(checkeeIds, checkeeIds + edges,
+                  [nodes](uint32_t id) { return id >= nodes; }) ||
+      std::any_of(order, order + orderSize,
+                  [nodes](uint32_t id) { return id >= nodes; })) {
+    malformed();
+  }
+
+  // names are looked up in place, in file order so that the node ids are
+  // kept when every function is found
+  std::vector<Function *> functions(nodes);
+  for (size_t node = 0; node < nodes; ++node) {
+    StringRef name(names + nameOffsets[node],
+                   nameOffsets[node + 1] - nameOffsets[node]);
+    functions[node] = module.getFunction(name);
+    if (functions[node]) {
+      builder.addNode(functions[node]);
+    } else {
+      dbgs() << "ERR. CheckersNetwork refers to unknown function " << name
+             << "\n";
+    }
+  }
+  for (size_t node = 0; node < nodes; ++node) {
+    if (!functions[node])
       continue;
+    for (uint32_t edge = checkeeOffsets[node]; edge < checkeeOffsets[node + 1];
+         ++edge) {
+      if (auto *checkee = functions[checkeeIds[edge]])
+        builder.addEdge(functions[node], checkee);
     }
-    dbgs() << "dumpJson: dumping checker:" << checker.first->getName() << "\n";
-    j["map"][checker.first->getName()] = json::array();
-    for (auto checkee : checker.second) {
-      j["map"][checker.first->getName()].push_back(checkee->getName());
-      if (std::find(uniqueCheckees.begin(), uniqueCheckees.end(), checkee) == uniqueCheckees.end()) {
-        j["allCheckees"].push_back(checkee->getName());
-        uniqueCheckees.push_back(checkee);
+  }
+  CheckerGraph graph = builder.build();
+  for (size_t i = 0; i < orderSize; ++i) {
+    if (auto *F = functions[order[i]])
+      reverseTopologicalSort.push_back(graph.lookup(F));
+  }
+  if (echo_network)
+    writeNetwork(std::cout, graph, reverseTopologicalSort);
+  return graph;
+}
+
+// Checkers in post-order of a depth first search over checker -> checkee
+// edges, i.e. every checker follows the checkers among its checkees. The search keeps its own stack so
+// that deep networks cannot overflow the call stack.
+std::vector<CheckerGraph::NodeId>
+DAGCheckersNetwork::getReverseTopologicalSort(const CheckerGraph &graph) {
+  std::vector<CheckerGraph::NodeId> List;
+  std::vector<bool> visited(graph.size(), false);
+  // (function, next checkee to visit)
+  std::vector<std::pair<CheckerGraph::NodeId, size_t>> stack;
+  for (CheckerGraph::NodeId root = 0; root < graph.size(); ++root) {
+    if (visited[root])
+      continue;
+    visited[root] = true;
+    stack.push_back({root, 0});
+    while (!stack.empty()) {
+      auto &top = stack.back();
+      auto checkees = graph.checkees(top.first);
+      if (top.second < checkees.size()) {
+        auto next = checkees[top.second++];
+        if (!visited[next]) {
+          visited[next] = true;
+          stack.push_back({next, 0});
+        }
+        continue;
       }
+      // only checkers are listed, checkees that check nothing are left out
+      if (!checkees.empty())
+        List.push_back(top.first);
+      stack.pop_back();
     }
-    dbgs() << "Dumped sucessfully\n";
-  }
-  j["topologicalsort"] = json::array();
-  for (auto &tsort_checker : reverseTopologicalSort) {
-    j["topologicalsort"].push_back(tsort_checker->getName());
   }
-  std::cout << j.dump(4) << std::endl;
-  std::ofstream o(filePath);
-  o << std::setw(4) << j << std::endl;
-}
-
-void topologicalSortUtil(int v, Function *F,
-                         std::unique_ptr<bool[]> &visited,
-                         std::list<Function *> &List,
-                         const std::map<Function *, std::vector<Function *>> &checkerCheckeeMap,
-                         std::vector<Function *> allFunctions) {
-  // mark node as visited
-  visited[v] = true;
-  // recur for all vertices adjacent to this vertex
-  auto it = checkerCheckeeMap.find(F);
-  if (it == checkerCheckeeMap.end())
-    return;
-
-  for (auto i : it->second) {
-    auto function_it = std::find(allFunctions.begin(), allFunctions.end(), i);
-    int index = static_cast<int>(std::distance(allFunctions.begin(), function_it));
-    if (!visited[index])
-      topologicalSortUtil(index, *function_it, visited, List, checkerCheckeeMap, allFunctions);
-  }
-  List.push_back(allFunctions[v]);
-}
-
-std::vector<Function *> getAllFunctions(const std::map<Function *, std::vector<Function *>>& checkerCheckeeMap) {
-
-  std::vector<Function *> functions;
-  for (auto &map : checkerCheckeeMap) {
-    Function *checker = map.first;
-    if (std::find(functions.begin(), functions.end(), checker) == functions.end())
-      functions.push_back(checker);
-    for (auto &checkee : map.second) {
-      if (std::find(functions.begin(), functions.end(), checkee) == functions.end())
-        functions.push_back(checkee);
-    }
-  }
-  return functions;
-}
-
-std::list<Function *> DAGCheckersNetwork::getReverseTopologicalSort(std::map<Function *,
-                                                                             std::vector<Function *>> checkerCheckeeMap) {
-  std::list<Function *> List;
-  // Mark all vetices as not visited
-  std::vector<Function *> AllFunctions = getAllFunctions(checkerCheckeeMap);
-  int V = static_cast<int>(AllFunctions.size());
-  std::unique_ptr<bool[]> visited(new bool[V]);
-  for (int i = 0; i < V; i++)
-    visited[i] = false;
-  // call recursive helper to store the sort
-  for (int i = 0; i < V; i++) {
-    auto function = AllFunctions[i];
-    if (!visited[i])
-      topologicalSortUtil(i, function, visited, List, checkerCheckeeMap, AllFunctions);
-  }
-  dbgs() << "DAGCheckersNetwork::getReverseTopologicalSort freed visited\n";
   return List;
 }
 
-std::vector<Function *> randomComb(int connectivity,
-                                   std::vector<Function *> allFunctions) {
-  std::vector<unsigned int> indices(allFunctions.size());
-  std::iota(indices.begin(), indices.end(), 0);
+namespace {
+// Checkers still available while the network is built. Random draws take a
+// partial Fisher-Yates shuffle of the first k slots and removal swaps the
+// last checker into the freed slot, both O(1) per checker. MinCost keeps the
+// open checkers ordered cold first: the cost of a guard is frequency(checker)
+// * size(checkee), so for any checkee the coldest checkers are the cheapest.
+// A checker closes when it is removed or carries `cap` guards, which keeps
+// the network from collapsing into a star around the coldest ones; when too
+// few stay open the cap doubles and the full checkers reopen.
+class CheckerPool {
+public:
+  // An empty frequency vector draws at random, otherwise the checkers are
+  // sorted cold first
+  CheckerPool(std::vector<Function *> checkers, bool ordered, size_t cap)
+      : checkers(std::move(checkers)), ordered(ordered), cap(cap) {
+    for (size_t i = 0; i < this->checkers.size(); ++i)
+      slot[this->checkers[i]] = i;
+    alive = this->checkers.size();
+    if (ordered) {
+      assigned.assign(this->checkers.size(), 0);
+      removed.assign(this->checkers.size(), false);
+      for (size_t i = 0; i < this->checkers.size(); ++i)
+        open.insert(open.end(), i);
+    }
+  }
 
-  //auto rd = std::random_device{};
-  //auto rng = std::default_random_engine{rd()};
-  auto rng = std::default_random_engine{};
-  std::shuffle(indices.begin(), indices.end(), rng);
-  std::vector<Function *> premutation;
-  if (connectivity > allFunctions.size())
-    connectivity = static_cast<int>(allFunctions.size());
+  bool empty() const { return alive == 0; }
+  bool contains(Function *F) const { return slot.count(F) != 0; }
 
-  premutation.reserve(static_cast<unsigned long>(connectivity));
-  for (int i = 0; i < connectivity; ++i) {
-    premutation.push_back(allFunctions[indices[i]]);
+  void remove(Function *F) {
+    auto it = slot.find(F);
+    if (it == slot.end())
+      return;
+    size_t i = it->second;
+    slot.erase(it);
+    --alive;
+    if (ordered) {
+      removed[i] = true;
+      open.erase(i);
+      return;
+    }
+    Function *last = checkers.back();
+    checkers[i] = last;
+    checkers.pop_back();
+    if (last != F)
+      slot[last] = i;
+  }
+
+  std::vector<Function *> sample(size_t k, std::default_random_engine &rng) {
+    k = std::min(k, alive);
+    std::vector<Function *> picked;
+    picked.reserve(k);
+    for (size_t i = 0; i < k; ++i) {
+      std::uniform_int_distribution<size_t> pick(i, checkers.size() - 1);
+      size_t j = pick(rng);
+      std::swap(checkers[i], checkers[j]);
+      slot[checkers[i]] = i;
+      slot[checkers[j]] = j;
+      picked.push_back(checkers[i]);
+    }
+    return picked;
+  }
+
+  // The k coldest checkers below the cap
+  std::vector<Function *> cheapest(size_t k) {
+    k = std::min(k, alive);
+    while (open.size() < k)
+      raiseCap();
+    std::vector<Function *> picked;
+    for (auto i : open) {
+      if (picked.size() == k)
+        break;
+      picked.push_back(checkers[i]);
+    }
+    return picked;
   }
-  return premutation;
-}
 
-std::map<Function *, std::vector<Function *>>
+  // Accounts a guard to the checker
+  void assign(Function *F) {
+    auto it = slot.find(F);
+    if (!ordered || it == slot.end())
+      return;
+    size_t i = it->second;
+    if (++assigned[i] >= cap)
+      open.erase(i);
+  }
+
+private:
+  void raiseCap() {
+    cap *= 2;
+    for (size_t i = 0; i < checkers.size(); ++i)
+      if (!removed[i] && assigned[i] < cap)
+        open.insert(i);
+  }
+
+  std::vector<Function *> checkers;
+  bool ordered;
+  size_t cap;
+  DenseMap<Function *, size_t> slot;
+  std::vector<size_t> assigned;
+  std::vector<bool> removed;
+  // slots of the checkers below the cap, i.e. cold first
+  std::set<size_t> open;
+  size_t alive;
+};
+} // namespace
+
+CheckerGraph
 DAGCheckersNetwork::constructProtectionNetwork(
     std::vector<Function *> sensitiveFunctions,
-    std::vector<Function *> checkerFunctions, int connectivity) {
+    std::vector<Function *> checkerFunctions, int connectivity,
+    std::default_random_engine &rng) {
 
-  std::map<Function *, std::vector<Function *>> checkeeChecker;
-  std::map<Function *, std::vector<Function *>> checkerCheckee;
+  CheckerGraph::Builder network;
 
-  std::vector<Function *> availableCheckees = sensitiveFunctions;
-  std::vector<Function *> availableCheckers = checkerFunctions;
-  std::vector<Function *> visited;
+  auto c = static_cast<size_t>(connectivity);
+  size_t cap = 0;
+  if (strategy == Strategy::MinCost) {
+    // The cost of a guard is frequency(checker) * size(checkee), the coldest
+    // checkers below the cap are taken. A checkee leaves the candidates when
+    // it is processed, hence hot
+    // sensitive functions go first so that cold ones stay available as
+    // checkers for longer. The stable sorts keep the caller's shuffled order
+    // among equally hot functions.
+    auto colder = [this](Function *a, Function *b) {
+      return frequencyOf(a) < frequencyOf(b);
+    };
+    std::stable_sort(checkerFunctions.begin(), checkerFunctions.end(),
+                     colder);
+    // With pinned checkers the caller's order has to be kept, see
+    // setPinnedCheckers
+    if (pinnedCheckers.empty())
+      std::stable_sort(sensitiveFunctions.begin(), sensitiveFunctions.end(),
+                       [&colder](Function *a, Function *b) {
+                         return colder(b, a);
+                       });
+    cap = maxGuardsPerChecker;
+    if (cap == 0 && !checkerFunctions.empty()) {
+      // twice the guards an even spread would give every checker
+      size_t guards = c * sensitiveFunctions.size();
+      cap = 2 * ((guards + checkerFunctions.size() - 1) /
+                 checkerFunctions.size());
+    }
+    cap = std::max(cap, size_t(1));
+  }
+  checkeeOrder = sensitiveFunctions;
+  CheckerPool availableCheckers(std::move(checkerFunctions),
+                                strategy == Strategy::MinCost, cap);
+  // every sensitive function is a node, also the ones that end up without
+  // checkers, so that their connectivity shows up in the stats
+  for (auto *F : sensitiveFunctions)
+    network.addNode(F);
+  double totalCost = 0;
+  // every sensitive function is checked by `connectivity` checkers,
+  // nonsensitive functions only do checking and never get checked (#48)
   for (auto &F : sensitiveFunctions) {
     dbgs() << "Checker function:" << F->getName() << "\n";
-    //availableCheckees.erase(
-    //    std::remove(availableCheckees.begin(), availableCheckees.end(), F),
-    //    availableCheckees.end());
-    availableCheckers.erase(
-        std::remove(availableCheckers.begin(), availableCheckers.end(), F),
-        availableCheckers.end());
-    //visited.push_back(F);
+    availableCheckers.remove(F);
 
     if (availableCheckers.empty())
       break;
-    int c = connectivity;
-    if (std::find(sensitiveFunctions.begin(), sensitiveFunctions.end(), F) ==
-        sensitiveFunctions.end()) {
-      // when it's not a sensitive function, we randomly set the connectivity
-      c = 0;//#48 nonsensitive functions only do checking do not get checked
-      //rand() % (connectivity + 1);
-      //dbgs() << "random connectivity for nonsensitive:" << c << "\n";
-    }
-
-    /*std::vector<Function *> possibleCheckees = sensitiveFunctions;
-    for (auto &vis:visited){
-      possibleCheckees.erase(
-        std::remove(possibleCheckees.begin(), possibleCheckees.end(), vis),
-        possibleCheckees.end());
-    }*/
-
-    checkeeChecker[F] = randomComb(c, availableCheckers);
+
+    std::vector<Function *> checkers;
+    auto pinned = pinnedCheckers.find(F);
+    if (pinned != pinnedCheckers.end()) {
+      for (auto *checker : pinned->second)
+        if (checkers.size() < c && availableCheckers.contains(checker))
+          checkers.push_back(checker);
+    }
+    if (checkers.size() < c) {
+      // the candidates may repeat pinned checkers, c of them always leave
+      // enough new ones
+      std::vector<Function *> candidates;
+      if (strategy == Strategy::MinCost) {
+        candidates = availableCheckers.cheapest(c);
+      } else {
+        candidates = availableCheckers.sample(c, rng);
+      }
+      for (auto *checker : candidates) {
+        if (checkers.size() == c)
+          break;
+        if (std::find(checkers.begin(), checkers.end(), checker) ==
+            checkers.end())
+          checkers.push_back(checker);
+      }
+    }
     //if(checkeeChecker[F].size()!=c)
     errs() << "C is set to " << c << " while size of checkees for " << F->getName() << " is "
-           << checkeeChecker[F].size() << "\n";
+           << checkers.size() << "\n";
     //exit(1);
-  }
 
-  for (auto &map : checkeeChecker) {
-    auto &checkee = map.first;
-    dbgs() << "Checkee:" << checkee->getName() << "\n";
-    if (std::find(sensitiveFunctions.begin(), sensitiveFunctions.end(), checkee) !=
-        sensitiveFunctions.end()) {
-      // this is a sensitive function assure that the number of checkers is
-      // equal to the connectivity level
-      if (map.second.size() != connectivity) {
-        if (!accept_lower_connectivity) {
-          errs() << "DAGCheckersNetwork: connectivity level is not preserved for "
-                    "sensitive functions\n";
-          exit(1);
-        } else {
-          dbgs() << "DAGCheckersNetwork: connectivity level is not preserved for " << checkee->getName() << "\n";
-
-        }
+    // assure that the number of checkers is equal to the connectivity level
+    if (checkers.size() != c) {
+      if (!accept_lower_connectivity) {
+        errs() << "DAGCheckersNetwork: connectivity level is not preserved for "
+                  "sensitive functions\n";
+        exit(1);
+      } else {
+        dbgs() << "DAGCheckersNetwork: connectivity level is not preserved for " << F->getName() << "\n";
       }
     }
-    for (auto &checker : map.second) {
-      checkerCheckee[checker].push_back(checkee);
+    dbgs() << "Checkee:" << F->getName() << "\n";
+    for (auto *checker : checkers) {
+      availableCheckers.assign(checker);
+      totalCost += guardCost(checker, F);
+      network.addEdge(checker, F);
       dbgs() << checker->getName() << ",";
     }
     dbgs() << "\n";
   }
-  return checkerCheckee;
+
+  dbgs() << "DAGCheckersNetwork: expected guard cost of the network "
+         << totalCost << "\n";
+  return network.build();
 }
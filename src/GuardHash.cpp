@@ -0,0 +1,130 @@
+#include "self-checksumming/GuardHash.h"
+#include <array>
+#include <cstring>
+
+const char *guardHashName(GuardHash hash) {
+  switch (hash) {
+  case GuardHash::CRC32C:
+    return "crc32c";
+  case GuardHash::Adler32:
+    return "adler32";
+  case GuardHash::Mix64:
+    return "mix64";
+  case GuardHash::XOR:
+  default:
+    return "xor";
+  }
+}
+
+const char *guardHashEntryPoint(GuardHash hash) {
+  switch (hash) {
+  case GuardHash::CRC32C:
+    return "guardMeCRC32C";
+  case GuardHash::Adler32:
+    return "guardMeAdler32";
+  case GuardHash::Mix64:
+    return "guardMeMix64";
+  case GuardHash::XOR:
+  default:
+    return "guardMe";
+  }
+}
+
+bool parseGuardHash(const std::string &name, GuardHash &hash) {
+  for (auto candidate : {GuardHash::XOR, GuardHash::CRC32C, GuardHash::Adler32,
+                         GuardHash::Mix64}) {
+    if (name == guardHashName(candidate)) {
+      hash = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+namespace {
+// see SC_MIX64_P1..P5 in rtlib.c
+constexpr uint64_t Mix64P1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t Mix64P2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t Mix64P3 = 0x165667B19E3779F9ULL;
+constexpr uint64_t Mix64P4 = 0x85EBCA77C2B2AE63ULL;
+constexpr uint64_t Mix64P5 = 0x27D4EB2F165667C5ULL;
+
+uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+std::array<uint32_t, 256> makeCRC32CTable() {
+  std::array<uint32_t, 256> table{};
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; ++bit)
+      crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78u : crc >> 1;
+    table[i] = crc;
+  }
+  return table;
+}
+
+uint32_t hashXOR(const uint8_t *data, size_t length) {
+  uint32_t hash = 0;
+  for (size_t i = 0; i < length; ++i)
+    hash ^= data[i];
+  return hash;
+}
+
+uint32_t hashCRC32C(const uint8_t *data, size_t length) {
+  static const std::array<uint32_t, 256> table = makeCRC32CTable();
+  uint32_t crc = 0xFFFFFFFFu;
+  for (size_t i = 0; i < length; ++i)
+    crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+uint32_t hashAdler32(const uint8_t *data, size_t length) {
+  uint64_t a = 1, b = 0;
+  while (length) {
+    size_t block = length < 5552 ? length : 5552;
+    length -= block;
+    while (block--) {
+      a += *data++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return static_cast<uint32_t>((b << 16) | a);
+}
+
+uint32_t hashMix64(const uint8_t *data, size_t length) {
+  uint64_t h = Mix64P5;
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, data + i, sizeof(word));
+    h ^= rotl64(word * Mix64P2, 31) * Mix64P1;
+    h = rotl64(h, 27) * Mix64P1 + Mix64P4;
+  }
+  for (; i < length; ++i) {
+    h ^= data[i] * Mix64P5;
+    h = rotl64(h, 11) * Mix64P1;
+  }
+  h ^= length;
+  h ^= h >> 33;
+  h *= Mix64P2;
+  h ^= h >> 29;
+  h *= Mix64P3;
+  h ^= h >> 32;
+  return static_cast<uint32_t>(h ^ (h >> 32));
+}
+} // namespace
+
+uint32_t computeGuardHash(GuardHash hash, const uint8_t *data, size_t length) {
+  switch (hash) {
+  case GuardHash::CRC32C:
+    return hashCRC32C(data, length);
+  case GuardHash::Adler32:
+    return hashAdler32(data, length);
+  case GuardHash::Mix64:
+    return hashMix64(data, length);
+  case GuardHash::XOR:
+  default:
+    return hashXOR(data, length);
+  }
+}
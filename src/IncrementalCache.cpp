@@ -0,0 +1,163 @@
+#include "self-checksumming/IncrementalCache.h"
+#include "nlohmann/json.hpp"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/MD5.h"
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+
+using namespace llvm;
+using json = nlohmann::json;
+
+namespace {
+const int CacheVersion = 1;
+
+class StructuralHasher {
+public:
+  explicit StructuralHasher(const Function &F) {
+    unsigned index = 0;
+    for (auto &BB : F) {
+      numbers[&BB] = index++;
+      for (auto &I : BB)
+        numbers[&I] = index++;
+    }
+  }
+
+  void add(uint64_t value) {
+    hash.update(ArrayRef<uint8_t>(reinterpret_cast<const uint8_t *>(&value),
+                                  sizeof(value)));
+  }
+
+  void add(StringRef value) {
+    add(value.size());
+    hash.update(value);
+  }
+
+  void add(Type *type) {
+    add(type->getTypeID());
+    if (type->isIntegerTy())
+      add(type->getIntegerBitWidth());
+    if (auto *structType = dyn_cast<StructType>(type))
+      if (structType->hasName())
+        add(structType->getName());
+    for (auto *contained : type->subtypes())
+      add(contained->getTypeID());
+  }
+
+  void add(const Value *value, unsigned depth = 0) {
+    add(value->getValueID());
+    auto number = numbers.find(value);
+    if (number != numbers.end()) {
+      add(number->second);
+      return;
+    }
+    if (auto *argument = dyn_cast<Argument>(value)) {
+      add(argument->getArgNo());
+    } else if (auto *global = dyn_cast<GlobalValue>(value)) {
+      add(global->getName());
+    } else if (auto *constant = dyn_cast<ConstantInt>(value)) {
+      add(constant->getBitWidth());
+      add(constant->getValue().getLimitedValue());
+    } else if (auto *constant = dyn_cast<ConstantFP>(value)) {
+      add(constant->getValueAPF().bitcastToAPInt().getLimitedValue());
+    } else if (auto *data = dyn_cast<ConstantDataSequential>(value)) {
+      add(data->getRawDataValues());
+    } else if (auto *assembly = dyn_cast<InlineAsm>(value)) {
+      add(assembly->getAsmString());
+      add(assembly->getConstraintString());
+    } else if (auto *constant = dyn_cast<Constant>(value)) {
+      add(constant->getType());
+      if (auto *expression = dyn_cast<ConstantExpr>(constant))
+        add(expression->getOpcode());
+      // constant expressions and aggregates, bounded against deep nesting
+      if (depth < 8) {
+        for (auto &operand : constant->operands())
+          add(operand.get(), depth + 1);
+      }
+    }
+  }
+
+  void add(const Instruction &I) {
+    add(I.getOpcode());
+    add(I.getType());
+    if (auto *compare = dyn_cast<CmpInst>(&I))
+      add(compare->getPredicate());
+    if (auto *alloca = dyn_cast<AllocaInst>(&I))
+      add(alloca->getAllocatedType());
+    for (auto &operand : I.operands())
+      add(operand.get());
+  }
+
+  uint64_t result() {
+    MD5::MD5Result digest;
+    hash.final(digest);
+    return digest.low();
+  }
+
+private:
+  MD5 hash;
+  DenseMap<const Value *, unsigned> numbers;
+};
+} // namespace
+
+uint64_t structuralHash(const Function &F) {
+  StructuralHasher hasher(F);
+  hasher.add(F.getFunctionType());
+  for (auto &argument : F.args())
+    hasher.add(argument.getType());
+  for (auto &BB : F) {
+    hasher.add(static_cast<uint64_t>(BB.size()));
+    for (auto &I : BB)
+      hasher.add(I);
+  }
+  return hasher.result();
+}
+
+bool IncrementalCache::read(const std::string &path) {
+  std::ifstream stream(path);
+  if (!stream.is_open())
+    return false;
+  json j = json::parse(stream, nullptr, false);
+  if (!j.is_object() || j["version"] != CacheVersion)
+    return false;
+  for (auto &entry : j["functions"].items()) {
+    if (!entry.value().is_string())
+      return false;
+    hashes[entry.key()] =
+        strtoull(entry.value().get<std::string>().c_str(), nullptr, 16);
+  }
+  for (auto &function : j["order"]) {
+    if (!function.is_string())
+      return false;
+    order.push_back(function.get<std::string>());
+  }
+  for (auto &entry : j["checkers"].items()) {
+    auto &names = checkers[entry.key()];
+    for (auto &checker : entry.value()) {
+      if (!checker.is_string())
+        return false;
+      names.push_back(checker.get<std::string>());
+    }
+  }
+  return true;
+}
+
+bool IncrementalCache::write(const std::string &path) const {
+  json j;
+  j["version"] = CacheVersion;
+  j["functions"] = json::object();
+  for (auto &entry : hashes) {
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016" PRIx64, entry.second);
+    j["functions"][entry.first] = hex;
+  }
+  j["order"] = order;
+  j["checkers"] = checkers;
+  std::ofstream o(path);
+  o << j.dump(1) << std::endl;
+  return static_cast<bool>(o);
+}
@@ -0,0 +1,237 @@
+#include "self-checksumming/PatchGuide.h"
+#include <algorithm>
+#include <cxxabi.h>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdlib.h>
+
+std::string demangle_name(const std::string &name) {
+  int status = -1;
+  char *demangled =
+      abi::__cxa_demangle(name.c_str(), nullptr, nullptr, &status);
+  if (status != 0) {
+    return name;
+  }
+  std::string demangled_name(demangled);
+  free(demangled);
+  demangled_name.erase(
+      std::remove(demangled_name.begin(), demangled_name.end(), ' '),
+      demangled_name.end());
+  for (char &c : demangled_name) {
+    if (c == '(' || c == '*' || c == '&' || c == ')' || c == ',' || c == '<' ||
+        c == '>' || c == '~' || c == '[' || c == ']') {
+      c = '_';
+    }
+  }
+  return demangled_name;
+}
+
+static bool parseUnsigned(const std::string &field, unsigned int &value) {
+  char *end = nullptr;
+  unsigned long parsed = strtoul(field.c_str(), &end, 10);
+  if (field.empty() || *end != '\0' || parsed > UINT_MAX) {
+    return false;
+  }
+  value = static_cast<unsigned int>(parsed);
+  return true;
+}
+
+namespace {
+const char BinaryGuideMagic[4] = {'S', 'C', 'G', '1'};
+const uint32_t NoTableIndex = 0xFFFFFFFFu;
+
+bool readTextPatchGuide(std::istream &stream,
+                        std::vector<GuardPatch> &patches) {
+  std::string line;
+  while (std::getline(stream, line)) {
+    if (line.empty()) {
+      continue;
+    }
+    std::vector<std::string> fields;
+    std::stringstream lineStream(line);
+    std::string field;
+    while (std::getline(lineStream, field, ',')) {
+      fields.push_back(field);
+    }
+    GuardPatch patch;
+    const char *error = nullptr;
+    if (fields.size() < 4) {
+      error = "too few fields";
+    } else {
+      patch.function = fields[0];
+      if (!parseUnsigned(fields[1], patch.addressPlaceholder) ||
+          !parseUnsigned(fields[2], patch.sizePlaceholder) ||
+          !parseUnsigned(fields[3], patch.hashPlaceholder)) {
+        error = "malformed placeholder";
+      }
+      // guides written before -sc-hash existed carry no algorithm column
+      if (fields.size() > 4 && !parseGuardHash(fields[4], patch.hash)) {
+        error = "unknown hash algorithm";
+      }
+      unsigned int tableIndex = 0;
+      if (fields.size() > 5) {
+        if (parseUnsigned(fields[5], tableIndex)) {
+          patch.tableIndex = static_cast<int>(tableIndex);
+        } else {
+          error = "malformed table index";
+        }
+      }
+    }
+    if (error) {
+      std::cerr << "ERR. Malformed patch guide line '" << line
+                << "': " << error << "\n";
+      return false;
+    }
+    patches.push_back(patch);
+  }
+  return true;
+}
+
+bool readBinaryPatchGuide(std::istream &stream,
+                          std::vector<GuardPatch> &patches) {
+  uint32_t header[2];
+  if (!stream.read(reinterpret_cast<char *>(header), sizeof(header))) {
+    std::cerr << "ERR. Truncated binary patch guide header\n";
+    return false;
+  }
+  // both sizes come from the file, check them against its length before
+  // anything is allocated for them
+  auto start = stream.tellg();
+  stream.seekg(0, std::ios::end);
+  auto remaining = static_cast<uint64_t>(stream.tellg() - start);
+  stream.seekg(start);
+  if (uint64_t(header[1]) + uint64_t(header[0]) * 6 * sizeof(uint32_t) >
+      remaining) {
+    std::cerr << "ERR. Truncated binary patch guide\n";
+    return false;
+  }
+  std::string names(header[1], '\0');
+  if (!stream.read(&names[0], names.size()) ||
+      (!names.empty() && names.back() != '\0')) {
+    std::cerr << "ERR. Truncated binary patch guide names\n";
+    return false;
+  }
+  patches.reserve(patches.size() + header[0]);
+  for (uint32_t i = 0; i < header[0]; ++i) {
+    uint32_t record[6];
+    if (!stream.read(reinterpret_cast<char *>(record), sizeof(record))) {
+      std::cerr << "ERR. Truncated binary patch guide, entry " << i << "\n";
+      return false;
+    }
+    if (record[0] >= names.size() || record[4] > 3) {
+      std::cerr << "ERR. Malformed binary patch guide entry " << i << "\n";
+      return false;
+    }
+    GuardPatch patch;
+    patch.function = names.c_str() + record[0];
+    patch.addressPlaceholder = record[1];
+    patch.sizePlaceholder = record[2];
+    patch.hashPlaceholder = record[3];
+    patch.hash = static_cast<GuardHash>(record[4]);
+    patch.tableIndex =
+        record[5] == NoTableIndex ? -1 : static_cast<int>(record[5]);
+    patches.push_back(patch);
+  }
+  return true;
+}
+} // namespace
+
+bool readPatchGuide(const std::string &path, std::vector<GuardPatch> &patches) {
+  std::ifstream stream(path, std::ifstream::binary);
+  if (!stream) {
+    std::cerr << "ERR. patch guide file " << path << " cannot be found!\n";
+    return false;
+  }
+  char magic[sizeof(BinaryGuideMagic)] = {};
+  stream.read(magic, sizeof(magic));
+  if (stream.gcount() == sizeof(magic) &&
+      !memcmp(magic, BinaryGuideMagic, sizeof(magic))) {
+    return readBinaryPatchGuide(stream, patches);
+  }
+  stream.clear();
+  stream.seekg(0);
+  return readTextPatchGuide(stream, patches);
+}
+
+std::string formatPatchGuideLine(const GuardPatch &patch) {
+  std::ostringstream line;
+  line << patch.function << "," << patch.addressPlaceholder << ","
+       << patch.sizePlaceholder << "," << patch.hashPlaceholder << ","
+       << guardHashName(patch.hash);
+  if (patch.tableIndex >= 0) {
+    line << "," << patch.tableIndex;
+  }
+  return line.str();
+}
+
+void PatchGuideWriter::add(const std::string &symbol,
+                           unsigned int addressPlaceholder,
+                           unsigned int sizePlaceholder,
+                           unsigned int hashPlaceholder, GuardHash hash,
+                           int tableIndex) {
+  GuardPatch patch;
+  patch.function = guideName(symbol);
+  patch.addressPlaceholder = addressPlaceholder;
+  patch.sizePlaceholder = sizePlaceholder;
+  patch.hashPlaceholder = hashPlaceholder;
+  patch.hash = hash;
+  patch.tableIndex = tableIndex;
+  patches.push_back(std::move(patch));
+}
+
+const std::string &PatchGuideWriter::guideName(const std::string &symbol) {
+  auto it = guideNames.find(symbol);
+  if (it == guideNames.end()) {
+    it = guideNames.emplace(symbol, demangle_name(symbol)).first;
+  }
+  return it->second;
+}
+
+bool PatchGuideWriter::write(const std::string &path,
+                             PatchGuideFormat format) const {
+  if (format == PatchGuideFormat::Binary) {
+    return writeBinary(path);
+  }
+  std::string text;
+  for (const auto &patch : patches) {
+    text += formatPatchGuideLine(patch);
+    text += '\n';
+  }
+  std::ofstream stream(path, std::ofstream::app);
+  stream << text;
+  return static_cast<bool>(stream);
+}
+
+bool PatchGuideWriter::writeBinary(const std::string &path) const {
+  std::string names;
+  std::map<std::string, uint32_t> nameOffsets;
+  std::vector<uint32_t> records;
+  records.reserve(patches.size() * 6);
+  for (const auto &patch : patches) {
+    auto inserted = nameOffsets.emplace(patch.function, names.size());
+    if (inserted.second) {
+      names += patch.function;
+      names += '\0';
+    }
+    records.push_back(inserted.first->second);
+    records.push_back(patch.addressPlaceholder);
+    records.push_back(patch.sizePlaceholder);
+    records.push_back(patch.hashPlaceholder);
+    records.push_back(static_cast<uint32_t>(patch.hash));
+    records.push_back(patch.tableIndex < 0
+                          ? NoTableIndex
+                          : static_cast<uint32_t>(patch.tableIndex));
+  }
+  uint32_t header[2] = {static_cast<uint32_t>(patches.size()),
+                        static_cast<uint32_t>(names.size())};
+  std::ofstream stream(path, std::ofstream::binary | std::ofstream::trunc);
+  stream.write(BinaryGuideMagic, sizeof(BinaryGuideMagic));
+  stream.write(reinterpret_cast<const char *>(header), sizeof(header));
+  stream.write(names.data(), names.size());
+  stream.write(reinterpret_cast<const char *>(records.data()),
+               records.size() * sizeof(uint32_t));
+  return static_cast<bool>(stream);
+}
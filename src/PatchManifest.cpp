@@ -1,31 +1,223 @@
 #include "self-checksumming/PatchManifest.h"
 #include "nlohmann/json.hpp"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
 #include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-void PatchManifest::readPatchManifest(const std::string& manifestFilePath) {
+namespace {
+const char ManifestMagic[4] = {'S', 'C', 'M', '1'};
+const size_t HeaderWords = 1 + 2 * PatchManifest::NumKinds;
+// placeholders are dense, a wider range means a broken manifest
+const uint32_t MaxTableSize = 1u << 26;
+
+uint32_t bitmapWords(uint32_t count) { return (count + 31) / 32; }
+} // namespace
+
+PatchManifest::~PatchManifest() { unmap(); }
+
+void PatchManifest::unmap() {
+  if (mapping) {
+    munmap(mapping, mappingSize);
+    mapping = nullptr;
+  }
+}
+
+bool PatchManifest::readPatchManifest(const std::string &manifestFilePath) {
+  char magic[sizeof(ManifestMagic)] = {};
+  std::ifstream stream(manifestFilePath, std::ifstream::binary);
+  if (!stream) {
+    std::cerr << "ERR. Patch manifest " << manifestFilePath
+              << " cannot be opened\n";
+    return false;
+  }
+  stream.read(magic, sizeof(magic));
+  if (stream.gcount() == sizeof(magic) &&
+      !memcmp(magic, ManifestMagic, sizeof(magic))) {
+    return readBinaryManifest(manifestFilePath);
+  }
+  return readJsonManifest(manifestFilePath);
+}
+
+bool PatchManifest::readBinaryManifest(const std::string &manifestFilePath) {
+  int fd = open(manifestFilePath.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    std::cerr << "ERR. Patch manifest " << manifestFilePath
+              << " cannot be opened\n";
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+  unmap();
+  mappingSize = static_cast<size_t>(st.st_size);
+  mapping = mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    mapping = nullptr;
+    std::cerr << "ERR. Patch manifest " << manifestFilePath
+              << " cannot be mapped\n";
+    return false;
+  }
+
+  const auto *words = static_cast<const uint32_t *>(mapping);
+  size_t totalWords = mappingSize / sizeof(uint32_t);
+  if (totalWords < HeaderWords) {
+    std::cerr << "ERR. Truncated patch manifest " << manifestFilePath << "\n";
+    return false;
+  }
+  size_t offset = HeaderWords;
+  for (int kind = 0; kind < NumKinds; ++kind) {
+    Table &table = tables[kind];
+    table.base = words[1 + 2 * kind];
+    table.count = words[2 + 2 * kind];
+    if (table.count > MaxTableSize ||
+        offset + table.count + bitmapWords(table.count) > totalWords) {
+      std::cerr << "ERR. Truncated patch manifest " << manifestFilePath
+                << "\n";
+      return false;
+    }
+    table.targets = words + offset;
+    offset += table.count;
+    table.present = words + offset;
+    offset += bitmapWords(table.count);
+  }
+  return true;
+}
+
+bool PatchManifest::readJsonManifest(const std::string &manifestFilePath) {
   using json = nlohmann::json;
-  json root; // will contain the root value after parsing.
   std::ifstream stream(manifestFilePath, std::ifstream::binary);
-  stream >> root;
+  json root = json::parse(stream, nullptr, false);
+  if (!root.is_array()) {
+    std::cerr << "ERR. Malformed patch manifest " << manifestFilePath << "\n";
+    return false;
+  }
+  // placeholder and target key of each kind, in Kind order
+  const char *keys[NumKinds][2] = {{"add_placeholder", "add_target"},
+                                   {"size_placeholder", "size_target"},
+                                   {"hash_placeholder", "hash_target"}};
+  auto field = [](const json &patch, const char *key, uint32_t &value) {
+    auto it = patch.find(key);
+    if (it == patch.end() || !it->is_number_unsigned() ||
+        it->get<uint64_t>() > UINT32_MAX) {
+      return false;
+    }
+    value = it->get<uint32_t>();
+    return true;
+  };
+  // entries come in any order, each table is sized once from the range of
+  // its placeholders so that adding never shifts it
+  std::vector<uint32_t> values[NumKinds][2];
+  size_t entry = 0;
   for (const auto &patch : root) {
-    this->size_patches[patch["size_placeholder"].get<int>()] =
-        patch["size_target"].get<int>();
-    this->address_patches[patch["add_placeholder"].get<int>()] =
-        patch["add_target"].get<int>();
-    this->hash_patches[patch["hash_placeholder"].get<int>()] =
-        patch["hash_target"].get<int>();
+    for (int kind = 0; kind < NumKinds; ++kind) {
+      uint32_t placeholder, target;
+      if (!patch.is_object() || !field(patch, keys[kind][0], placeholder) ||
+          !field(patch, keys[kind][1], target)) {
+        std::cerr << "ERR. Malformed patch manifest " << manifestFilePath
+                  << ", entry " << entry << "\n";
+        return false;
+      }
+      values[kind][0].push_back(placeholder);
+      values[kind][1].push_back(target);
+    }
+    ++entry;
   }
+  for (int kind = 0; kind < NumKinds; ++kind) {
+    const auto &placeholders = values[kind][0];
+    if (placeholders.empty()) {
+      continue;
+    }
+    auto range = std::minmax_element(placeholders.begin(), placeholders.end());
+    if (*range.second - *range.first >= MaxTableSize) {
+      std::cerr << "ERR. Malformed patch manifest " << manifestFilePath
+                << ", placeholders are not dense\n";
+      return false;
+    }
+    reserve(static_cast<Kind>(kind), *range.first, *range.second);
+    for (size_t i = 0; i < placeholders.size(); ++i) {
+      add(static_cast<Kind>(kind), placeholders[i], values[kind][1][i]);
+    }
+  }
+  return true;
 }
 
-int main() {
+void PatchManifest::reserve(Kind kind, uint32_t low, uint32_t high) {
+  Table &table = tables[kind];
+  if (!table.targets || table.targets != table.targetStorage.data()) {
+    // first entry, or the table was mapped: copy it into owned storage
+    table.targetStorage.assign(table.targets, table.targets + table.count);
+    table.presentStorage.assign(table.present,
+                                table.present + bitmapWords(table.count));
+    if (!table.count) {
+      table.base = low;
+    }
+  }
+  if (low < table.base) {
+    uint32_t shift = table.base - low;
+    std::vector<uint32_t> targets(shift + table.count);
+    std::vector<uint32_t> present(bitmapWords(shift + table.count));
+    for (uint32_t i = 0; i < table.count; ++i) {
+      targets[shift + i] = table.targetStorage[i];
+      if (table.presentStorage[i / 32] & (1u << (i % 32))) {
+        present[(shift + i) / 32] |= 1u << ((shift + i) % 32);
+      }
+    }
+    table.targetStorage.swap(targets);
+    table.presentStorage.swap(present);
+    table.base = low;
+    table.count += shift;
+  }
+  uint32_t last = high - table.base;
+  if (last >= table.count) {
+    table.count = last + 1;
+    table.targetStorage.resize(table.count);
+    table.presentStorage.resize(bitmapWords(table.count));
+  }
+  table.targets = table.targetStorage.data();
+  table.present = table.presentStorage.data();
+}
 
-  PatchManifest patchManifest;
-  patchManifest.readPatchManifest("patch_guide");
+void PatchManifest::add(Kind kind, uint32_t placeholder, uint32_t target) {
+  reserve(kind, placeholder, placeholder);
+  Table &table = tables[kind];
+  uint32_t index = placeholder - table.base;
+  table.targetStorage[index] = target;
+  table.presentStorage[index / 32] |= 1u << (index % 32);
+}
 
-  std::cout << patchManifest.hash_patches.size() << "\n";
-  std::cout << patchManifest.size_patches.size() << "\n";
-  std::cout << patchManifest.address_patches.size() << "\n";
-  // std::string encoding = root.get("encoding", "UTF-8" ).asString();
-  // std::cout << encoding << "\n";
-  return 0;
+size_t PatchManifest::size(Kind kind) const {
+  const Table &table = tables[kind];
+  size_t entries = 0;
+  for (uint32_t i = 0; i < bitmapWords(table.count); ++i) {
+    entries += __builtin_popcount(table.present[i]);
+  }
+  return entries;
+}
+
+bool PatchManifest::writeBinaryManifest(
+    const std::string &manifestFilePath) const {
+  uint32_t header[HeaderWords - 1];
+  for (int kind = 0; kind < NumKinds; ++kind) {
+    header[2 * kind] = tables[kind].base;
+    header[2 * kind + 1] = tables[kind].count;
+  }
+  std::ofstream stream(manifestFilePath,
+                       std::ofstream::binary | std::ofstream::trunc);
+  stream.write(ManifestMagic, sizeof(ManifestMagic));
+  stream.write(reinterpret_cast<const char *>(header), sizeof(header));
+  for (const auto &table : tables) {
+    stream.write(reinterpret_cast<const char *>(table.targets),
+                 table.count * sizeof(uint32_t));
+    stream.write(reinterpret_cast<const char *>(table.present),
+                 bitmapWords(table.count) * sizeof(uint32_t));
+  }
+  return static_cast<bool>(stream);
 }
@@ -2,8 +2,14 @@
 #include "function-filter/Marker.hpp"
 #include "input-dependency/Analysis/FunctionInputDependencyResultInterface.h"
 #include "input-dependency/Analysis/InputDependencyAnalysisPass.h"
+#include "self-checksumming/CallFrequency.h"
+#include "self-checksumming/CheckerGraph.h"
 #include "self-checksumming/DAGCheckersNetwork.h"
+#include "self-checksumming/GuardHash.h"
+#include "self-checksumming/IncrementalCache.h"
+#include "self-checksumming/PatchGuide.h"
 #include "self-checksumming/Stats.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstrTypes.h"
@@ -14,17 +20,18 @@
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/Timer.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include <composition/graph/constraint/dependency.hpp>
 #include <composition/graph/constraint/present.hpp>
 #include <composition/support/Analysis.hpp>
-#include <cxxabi.h>
 #include <limits.h>
 #include <random>
 #include <sstream>
 #include <stdint.h>
+#include <sys/resource.h>
 
 using namespace llvm;
 using namespace composition;
@@ -53,6 +60,12 @@ static cl::opt<int> DesiredConnectivity(
     cl::desc(
         "The desired level of connectivity of checkers node in the network "));
 
+static cl::opt<unsigned> NetworkSeed(
+    "sc-seed", cl::Hidden,
+    cl::init(std::default_random_engine::default_seed),
+    cl::desc("Seed of the random engine that shuffles the functions and "
+             "samples the checkers of the network"));
+
 static cl::opt<int> MaximumPercOtherFunctions(
     "maximum-other-percentage", cl::Hidden,
     cl::desc("The maximum usage percentage (between 0 and 100) of other "
@@ -61,49 +74,219 @@ static cl::opt<int> MaximumPercOtherFunctions(
 
 static cl::opt<std::string> LoadCheckersNetwork(
     "load-checkers-network", cl::Hidden,
-    cl::desc("File path to load checkers' network in Json format "));
+    cl::desc("File path to load checkers' network in Json or binary format "));
+
+static cl::opt<std::string> IncrementalCachePath(
+    "sc-incremental-cache", cl::Hidden,
+    cl::desc("File path of the network cache kept across builds: sensitive "
+             "functions whose IR did not change keep their checkers, only "
+             "new and changed ones are placed. Ignored together with "
+             "-load-checkers-network"));
 
 static cl::opt<std::string>
     DumpSCStat("dump-sc-stat", cl::Hidden,
                cl::desc("File path to dump pass stat in Json format "));
 
+static cl::opt<std::string>
+    PatchGuidePath("sc-patch-guide", cl::Hidden, cl::init("guide.txt"),
+                   cl::desc("File path the patch guide is written to"));
+
+static cl::opt<PatchGuideFormat> PatchGuideFormatOpt(
+    "sc-patch-guide-format", cl::Hidden, cl::init(PatchGuideFormat::Text),
+    cl::desc("Encoding of the patch guide"),
+    cl::values(clEnumValN(PatchGuideFormat::Text, "text",
+                          "comma separated lines, one per guard"),
+               clEnumValN(PatchGuideFormat::Binary, "binary",
+                          "fixed size records, read by sc-patcher and "
+                          "dump_pipe.py")));
+
 static cl::opt<std::string> DumpCheckersNetwork(
     "dump-checkers-network", cl::Hidden,
     cl::desc("File path to dump checkers' network in Json format "));
 
+static cl::opt<DAGCheckersNetwork::NetworkFormat> CheckersNetworkFormat(
+    "checkers-network-format", cl::Hidden,
+    cl::init(DAGCheckersNetwork::NetworkFormat::Json),
+    cl::desc("Encoding of the dumped checkers' network"),
+    cl::values(clEnumValN(DAGCheckersNetwork::NetworkFormat::Json, "json",
+                          "human readable"),
+               clEnumValN(DAGCheckersNetwork::NetworkFormat::Binary, "binary",
+                          "mmapped by -load-checkers-network")));
+
+static cl::opt<bool> EchoCheckersNetwork(
+    "echo-checkers-network", cl::Hidden, cl::init(false),
+    cl::desc("Print the dumped or loaded checkers' network to stdout"));
+
+static cl::opt<bool> GuardTable(
+    "sc-guard-table", cl::Hidden,
+    cl::desc("Emit each guard as a single guardMeIdx(id) call into a read-only "
+             "table of {address, length, hash} descriptors that the patcher "
+             "fills in one contiguous region"));
+
+static cl::opt<bool> BatchGuards(
+    "sc-batch-guards", cl::Hidden,
+    cl::desc("Fold all guards of a checker into one guardMeBatch call over "
+             "the checker's slice of sc_guard_table"));
+
+static cl::opt<double> MaxGuardFrequency(
+    "sc-max-guard-frequency", cl::Hidden, cl::init(0),
+    cl::desc("Functions estimated to run more often than this are never "
+             "checkers. Profile entry counts are used when the module has "
+             "them, otherwise static estimates relative to one call of each "
+             "root function (0 disables the limit)"));
+
+static cl::opt<bool> ColdPlacement(
+    "sc-cold-placement", cl::Hidden,
+    cl::desc("Insert the guards of a checker into its least frequently "
+             "executed block (by profile counts or block frequency) instead "
+             "of its entry block"));
+
+static cl::opt<DAGCheckersNetwork::Strategy> NetworkStrategy(
+    "sc-network-strategy", cl::Hidden,
+    cl::init(DAGCheckersNetwork::Strategy::Random),
+    cl::desc("How checkers are assigned to checkees"),
+    cl::values(clEnumValN(DAGCheckersNetwork::Strategy::Random, "random",
+                          "Pick checkers at random (default)"),
+               clEnumValN(DAGCheckersNetwork::Strategy::MinCost, "cost",
+                          "Pick the checkers with the lowest expected cost, "
+                          "call frequency of the checker times IR size of "
+                          "the checkee")));
+
+static cl::opt<unsigned> MaxGuardsPerChecker(
+    "sc-max-guards-per-checker", cl::Hidden, cl::init(0),
+    cl::desc("Guards a checker carries under -sc-network-strategy=cost "
+             "before warmer checkers are taken (0: twice the even share)"));
+
+static cl::opt<unsigned> CheckEvery(
+    "sc-check-every", cl::Hidden, cl::init(1),
+    cl::desc("Table guards only hash their checkee on every N-th call"));
+
+static cl::opt<unsigned> CheckIntervalUs(
+    "sc-check-interval-us", cl::Hidden, cl::init(0),
+    cl::desc("Table guards only hash their checkee when at least this many "
+             "microseconds passed since their last check"));
+
+static cl::opt<unsigned> ChunkBytes(
+    "sc-chunk-bytes", cl::Hidden, cl::init(0),
+    cl::desc("Table guards hash only the next N bytes of their checkee per "
+             "call and compare once the whole checkee was covered"));
+
+static cl::list<std::string> RateLimits(
+    "sc-rate-limit", cl::Hidden, cl::CommaSeparated,
+    cl::value_desc("checker=every:interval-us"),
+    cl::desc("Overrides -sc-check-every and -sc-check-interval-us for the "
+             "guards placed in the given checker"));
+
+static cl::opt<GuardHash> GuardHashAlgorithm(
+    "sc-hash", cl::Hidden, cl::init(GuardHash::XOR),
+    cl::desc("Hash algorithm the guards use to check their checkees, the "
+             "choice is recorded in the patch guide for the patcher"),
+    cl::values(
+        clEnumValN(GuardHash::XOR, "xor", "8-bit XOR of all bytes (default)"),
+        clEnumValN(GuardHash::CRC32C, "crc32c",
+                   "CRC32C, SSE4.2 accelerated when available"),
+        clEnumValN(GuardHash::Adler32, "adler32", "Adler-32"),
+        clEnumValN(GuardHash::Mix64, "mix64",
+                   "64-bit multiply-mix hash folded to 32 bits")));
+
 namespace {
 
-std::string demangle_name(const std::string &name) {
-  int status = -1;
-  char *demangled =
-      abi::__cxa_demangle(name.c_str(), nullptr, nullptr, &status);
-  if (status != 0) {
-    return name;
-  }
-  std::string demangled_name(demangled);
-  demangled_name.erase(
-      std::remove(demangled_name.begin(), demangled_name.end(), ' '),
-      demangled_name.end());
-  for (char &c : demangled_name) {
-    if (c == '(' || c == '*' || c == '&' || c == ')' || c == ',' || c == '<' ||
-        c == '>' || c == '~' || c == '[' || c == ']') {
-      c = '_';
-    }
-  }
-  return demangled_name;
+// rtlib.c may be linked before the pass runs, its functions must never become
+// checkers or checkees. rtlib places all of them in this section (SC_RUNTIME).
+const char *const RuntimeSection = ".text.sc_runtime";
+
+bool isRuntimeFunction(const Function &F) {
+  return F.hasSection() && F.getSection() == RuntimeSection;
+}
+
+// Phases of SCPass that -dump-sc-stat times
+enum class Phase {
+  Classification,
+  NetworkConstruction,
+  TopologicalSort,
+  GuardInjection,
+  ManifestRegistration,
+  PatchGuideWrite,
+  StatsComputation,
+  NumPhases
+};
+
+const char *const PhaseNames[] = {
+    "classification",   "networkConstruction",  "topologicalSort",
+    "guardInjection",   "manifestRegistration", "patchGuideWrite",
+    "statsComputation"};
+
+const char *const PhaseDescriptions[] = {
+    "Function classification", "Network construction", "Topological sort",
+    "Guard injection",         "Manifest registration", "Patch guide write",
+    "Stats computation"};
+
+// peak resident set size of the process so far, in KiB
+long getPeakRss() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+  return usage.ru_maxrss;
 }
 
 struct SCPass : public composition::support::ComposableAnalysis<SCPass> {
   Stats stats;
+  TimerGroup phaseTimerGroup{"sc", "SCPass phases"};
+  Timer phaseTimers[static_cast<size_t>(Phase::NumPhases)];
+  long phasePeakRss[static_cast<size_t>(Phase::NumPhases)] = {};
+  PatchGuideWriter patchGuide;
+  CallFrequency callFrequency;
+  // IR instruction count per function, computed on first use
+  std::map<Function *, long> instructionCounts;
   static char ID;
 
-  SCPass() = default;
+  SCPass() {
+    for (size_t phase = 0; phase < static_cast<size_t>(Phase::NumPhases);
+         ++phase) {
+      phaseTimers[phase].init(PhaseNames[phase], PhaseDescriptions[phase],
+                              phaseTimerGroup);
+    }
+  }
+
+  // The phases are only timed when stats are requested. Injection and
+  // manifest registration interleave, a timer adds up all of its runs.
+  void startPhase(Phase phase) {
+    if (!DumpSCStat.empty())
+      phaseTimers[static_cast<size_t>(phase)].startTimer();
+  }
+
+  void stopPhase(Phase phase) {
+    if (DumpSCStat.empty())
+      return;
+    auto index = static_cast<size_t>(phase);
+    phaseTimers[index].stopTimer();
+    phasePeakRss[index] = getPeakRss();
+  }
 
   llvm::MDNode *sc_guard_md{};
   const std::string sc_guard_str = "sc_guard";
-
-  // Stats function list
-  std::map<Function *, int> ProtectedFuncs;
+  const std::string sc_guard_table_str = "sc_guard_table";
+
+  // Descriptors of table guards (-sc-guard-table), indexed by guardMeIdx's id
+  struct GuardDescriptor {
+    unsigned int address;
+    unsigned int length;
+    unsigned int expectedHash;
+    GuardHash hash;
+    // rate limit, see -sc-check-every and -sc-check-interval-us
+    unsigned int every;
+    unsigned int intervalUs;
+    // see -sc-chunk-bytes
+    unsigned int chunkBytes;
+  };
+  std::vector<GuardDescriptor> guardDescriptors;
+  std::map<std::string, std::pair<unsigned, unsigned>> rateLimitOverrides;
+  // -sc-guard-table, or implied by rate limits and chunking
+  bool useTable = false;
+
+  CheckerGraph checkerGraph;
+  // Stats: number of guards that check each node of checkerGraph
+  std::vector<int> protectedChecks;
   int numberOfGuards = 0;
   int numberOfGuardInstructions = 0;
   std::vector<Function *> sensitiveFunctions;
@@ -118,9 +301,9 @@ struct SCPass : public composition::support::ComposableAnalysis<SCPass> {
 
   bool assert_sensitive_only_checked_condition(
       const std::vector<Function *> sensitiveFunctions,
-      const std::map<Function *, std::vector<Function *>> &checkerFuncMap) {
+      const CheckerGraph &graph) {
     for (auto &func : sensitiveFunctions) {
-      if (checkerFuncMap.find(func) != checkerFuncMap.end()) {
+      if (graph.isChecker(func)) {
         errs() << "Sensitive functions are checkers while SensitiveOnlyChecked "
                   "is set to:"
                << SensitiveOnlyChecked << "\n";
@@ -144,12 +327,24 @@ struct SCPass : public composition::support::ComposableAnalysis<SCPass> {
     auto function_filter_info =
         getAnalysis<FunctionFilterPass>().get_functions_info();
 
+    parseRateLimits();
+    useTable = GuardTable;
+    if ((CheckEvery > 1 || CheckIntervalUs > 0 || !RateLimits.empty() ||
+         ChunkBytes > 0) &&
+        !GuardTable && !BatchGuards) {
+      // the limits, chunk sizes and per-guard state are kept per descriptor
+      dbgs() << "Rate-limited and chunked guards are table guards, enabling "
+                "-sc-guard-table\n";
+      useTable = true;
+    }
+
     auto *sc_guard_md_str = llvm::MDString::get(M.getContext(), sc_guard_str);
     sc_guard_md = llvm::MDNode::get(M.getContext(), sc_guard_md_str);
 
+    startPhase(Phase::Classification);
     int countProcessedFuncs = 0;
     for (auto &F : M) {
-      if (F.isDeclaration() || F.empty() || F.getName() == "guardMe")
+      if (F.isDeclaration() || F.empty() || isRuntimeFunction(F))
         continue;
 
       countProcessedFuncs++;
@@ -190,9 +385,7 @@ struct SCPass : public composition::support::ComposableAnalysis<SCPass> {
       }
     }
 
-    // auto rd = std::random_device{};
-    // auto rng = std::default_random_engine{rd()};
-    auto rng = std::default_random_engine{};
+    auto rng = std::default_random_engine{NetworkSeed};
 
     dbgs() << "Sensitive functions:" << sensitiveFunctions.size()
            << " other functions:" << otherFunctions.size() << "\n";
@@ -200,6 +393,7 @@ struct SCPass : public composition::support::ComposableAnalysis<SCPass> {
     std::shuffle(std::begin(sensitiveFunctions), std::end(sensitiveFunctions),
                  rng);
     std::shuffle(std::begin(otherFunctions), std::end(otherFunctions), rng);
+    stopPhase(Phase::Classification);
 
     if (DesiredConnectivity == 0) {
       DesiredConnectivity = 2;
@@ -255,14 +449,19 @@ struct SCPass : public composition::support::ComposableAnalysis<SCPass> {
 
     DAGCheckersNetwork checkerNetwork;
     checkerNetwork.setLowerConnectivityAcceptance(true);
+    checkerNetwork.setNetworkEcho(EchoCheckersNetwork);
     // map functions to checker checkee map nodes
-    std::list<Function *> topologicalSortFuncs;
-    std::map<Function *, std::vector<Function *>> checkerFuncMap;
+    std::vector<CheckerGraph::NodeId> topologicalSortFuncs;
     std::vector<int> actucalConnectivity;
     if (!LoadCheckersNetwork.empty()) {
 //        在程序运行时，可以通过命令行参数 -input=filename 来指定输入文件名。使用 InputFileName.getValue() 来获取该选项的值，并输出到控制台。
-      checkerFuncMap = checkerNetwork.loadJson(LoadCheckersNetwork.getValue(),
+      if (DAGCheckersNetwork::isBinaryNetwork(LoadCheckersNetwork)) {
+        checkerGraph = checkerNetwork.loadBinary(LoadCheckersNetwork.getValue(),
+                                                 M, topologicalSortFuncs);
+      } else {
+        checkerGraph = checkerNetwork.loadJson(LoadCheckersNetwork.getValue(),
                                                M, topologicalSortFuncs);
+      }
       if (!DumpSCStat.empty()) {
         // TODO: maybe we dump the stats into the JSON file and reload it just
         // like the network
@@ -270,6 +469,7 @@ struct SCPass : public composition::support::ComposableAnalysis<SCPass> {
         exit(1);
       }
     } else {
+      startPhase(Phase::NetworkConstruction);
       if (!SensitiveOnlyChecked &&
           !ExtractedOnly) // SensitiveOnlyChecked prevents sensitive function
         // being picked as checkers, extracted functions are
@@ -278,28 +478,55 @@ struct SCPass : public composition::support::ComposableAnalysis<SCPass> {
         otherFunctions.insert(otherFunctions.end(), sensitiveFunctions.begin(),
                               sensitiveFunctions.end());
       }
-      checkerFuncMap = checkerNetwork.constructProtectionNetwork(
-          sensitiveFunctions, otherFunctions, DesiredConnectivity);
+      if (MaxGuardFrequency > 0) {
+        excludeHotCheckers(M, otherFunctions);
+      }
+      checkerNetwork.setStrategy(NetworkStrategy);
+      if (NetworkStrategy == DAGCheckersNetwork::Strategy::MinCost) {
+        setCostModel(M, checkerNetwork, sensitiveFunctions, otherFunctions);
+        checkerNetwork.setMaxGuardsPerChecker(MaxGuardsPerChecker);
+      }
+      IncrementalCache cache;
+      if (!IncrementalCachePath.empty()) {
+        pinUnchangedCheckers(M, checkerNetwork, cache);
+      }
+      checkerGraph = checkerNetwork.constructProtectionNetwork(
+          sensitiveFunctions, otherFunctions, DesiredConnectivity, rng);
+      if (!IncrementalCachePath.empty()) {
+        saveIncrementalCache(checkerNetwork, cache);
+      }
+      stopPhase(Phase::NetworkConstruction);
+      startPhase(Phase::TopologicalSort);
       topologicalSortFuncs =
-          checkerNetwork.getReverseTopologicalSort(checkerFuncMap);
+          checkerNetwork.getReverseTopologicalSort(checkerGraph);
+      stopPhase(Phase::TopologicalSort);
       dbgs() << "Constructed the network of checkers!\n";
       if (SensitiveOnlyChecked || ExtractedOnly) {
         assert_sensitive_only_checked_condition(sensitiveFunctions,
-                                                checkerFuncMap);
+                                                checkerGraph);
       }
     }
     if (!DumpCheckersNetwork.empty()) {
       dbgs() << "Dumping checkers network info\n";
-      checkerNetwork.dumpJson(checkerFuncMap, DumpCheckersNetwork.getValue(),
-                              topologicalSortFuncs);
+      if (CheckersNetworkFormat == DAGCheckersNetwork::NetworkFormat::Binary) {
+        checkerNetwork.dumpBinary(checkerGraph, DumpCheckersNetwork.getValue(),
+                                  topologicalSortFuncs);
+      } else {
+        checkerNetwork.dumpJson(checkerGraph, DumpCheckersNetwork.getValue(),
+                                topologicalSortFuncs);
+      }
     } else {
       dbgs() << "No checkers network info file is requested!\n";
     }
     unsigned int marked_function_count = 0;
 
     // Fix for issue #58
+    protectedChecks.assign(checkerGraph.size(), 0);
+    std::vector<bool> sensitiveNode(checkerGraph.size(), false);
     for (auto &SF : sensitiveFunctions) {
-      ProtectedFuncs[SF] = 0;
+      auto node = checkerGraph.lookup(SF);
+      if (node != CheckerGraph::NoNode)
+        sensitiveNode[node] = true;
     }
 
     // inject one guard for each item in the checkee vector
@@ -308,12 +535,12 @@ struct SCPass : public composition::support::ComposableAnalysis<SCPass> {
 //      这段代码是在一个循环中为每个检查器函数中的每个被保护函数注入一条保护指令。
 //
 //      循环的过程如下：
-//      1. 对于拓扑排序后的每个检查器函数 `F`，从 `checkerFuncMap` 中查找它对应的被保护函数列表 `it->second`。
+//      1. 对于拓扑排序后的每个检查器函数 `F`，从 `checkerGraph` 中取出它对应的被保护函数列表 `checkeeNodes`。
 //      2. 对于每个被保护函数 `Checkee`，进行以下操作：
 //      a. 调用 `injectGuard` 函数，为被保护函数 `Checkee` 在检查器函数 `F` 的入口基本块中插入一条保护指令。该函数返回一个元组 `std::tuple`，其中第一个元素 `undoValues` 是需要撤销保护的值的集合，第二个元素 `_patchFunction` 是用于撤销保护的函数。
 //      b. 为了避免 Clang 编译器的一个 bug，将 `_patchFunction` 赋值给一个名为 `patchFunction` 的变量。
 //      c. 定义 `redo` 函数，该函数会在保护被撤销时执行。在该函数中，进行以下操作：
-//      - 如果被保护函数 `Checkee` 在敏感函数列表 `sensitiveFunctions` 中，则将 `Checkee` 对应的值在 `ProtectedFuncs` 中的计数加1，并在 `FunctionMarkerPass` 中记录 `Checkee`。
+//      - 如果被保护函数 `Checkee` 在敏感函数列表 `sensitiveFunctions` 中，则将 `Checkee` 对应的值在 `protectedChecks` 中的计数加1，并在 `FunctionMarkerPass` 中记录 `Checkee`。
 //      - 更新 `marked_function_count` 变量，表示已标记的函数数量加1。
 //      - 在调试输出中记录成功在检查器函数 `F` 中为被保护函数 `Checkee` 插入了保护指令。
 //      - 将 `numberOfGuards` 计数加1，表示成功插入了一条保护指令。
@@ -325,17 +552,73 @@ struct SCPass : public composition::support::ComposableAnalysis<SCPass> {
 //      h. 将 `didModify` 设置为 `true`，表示成功修改了函数模块。
 //
 //      循环执行完毕后，每个检查器函数中的被保护函数都成功插入了一条保护指令，并且相关的统计信息和保护列表都已更新。
-    for (auto &F : topologicalSortFuncs) {
-      auto it = checkerFuncMap.find(F);
-      if (it == checkerFuncMap.end())
+    startPhase(Phase::GuardInjection);
+    for (auto checker : topologicalSortFuncs) {
+      if (!checkerGraph.isChecker(checker))
         continue;
-      auto &BB = F->getEntryBlock();
+      auto *F = checkerGraph.function(checker);
+      auto checkeeNodes = checkerGraph.checkees(checker);
+      auto &BB = *selectGuardBlock(F);
 //        函数的作用是返回当前基本块（BasicBlock）中第一个非 PHI 节点（指令）或调试信息节点（DbgNode）的指针。这个函数用于遍历基本块的指令，并跳过所有的 PHI 节点和调试信息节点，直到找到第一个非 PHI 节点或调试信息节点为止。
       auto I = BB.getFirstNonPHIOrDbg();
 
       auto F_input_dependency_info = input_dependency_info->getAnalysisInfo(F);
-      for (auto &Checkee : it->second) {
-        assert(it->first != nullptr && "IT First is nullptr");
+      if (BatchGuards) {
+        // a single guardMeBatch call and manifest cover all checkees of F
+        std::vector<Function *> checkees;
+        std::vector<CheckerGraph::NodeId> sensitiveCheckees;
+        for (auto checkee : checkeeNodes) {
+          checkees.push_back(checkerGraph.function(checkee));
+          if (sensitiveNode[checkee])
+            sensitiveCheckees.push_back(checkee);
+        }
+        auto[undoValues, _patchFunction] =
+            injectBatchGuard(&BB, I, checkees, numberOfGuardInstructions);
+
+        // Clang compiler bug otherwise
+        auto patchFunction = _patchFunction;
+        auto redo = [checkees, sensitiveCheckees, function_info,
+            &marked_function_count, F, patchFunction, this](const Manifest &m) {
+          // only collect connectivity info for sensitive functions
+          for (auto checkee : sensitiveCheckees)
+            ++protectedChecks[checkee];
+          for (auto *Checkee : checkees) {
+            function_info->add_function(Checkee);
+            marked_function_count++;
+
+            dbgs() << "Insert batched guard in " << F->getName()
+                   << " checkee: " << Checkee->getName() << "\n";
+            numberOfGuards++;
+          }
+
+          patchFunction(m);
+        };
+
+        std::set<llvm::Value *> undoValueSet(undoValues.begin(),
+                                             undoValues.end());
+        std::vector<std::shared_ptr<graph::constraint::Constraint>>
+            constraints;
+        for (auto *Checkee : checkees) {
+          addGuardConstraints(constraints, F, Checkee);
+        }
+        // The protectee is the checker: the batch lives in (and is undone
+        // from) F. Conflicts are still resolved per checkee, each of them
+        // keeps the Dependency and Present constraints of a single guard.
+        auto m = new Manifest("sc", F, nullptr, redo, std::move(constraints),
+                              true, undoValueSet, patchInfo);
+        stopPhase(Phase::GuardInjection);
+        startPhase(Phase::ManifestRegistration);
+        addProtection(m);
+        stopPhase(Phase::ManifestRegistration);
+        startPhase(Phase::GuardInjection);
+
+        didModify = true;
+        continue;
+      }
+      for (auto checkee : checkeeNodes) {
+        auto *Checkee = checkerGraph.function(checkee);
+        bool sensitive = sensitiveNode[checkee];
+        assert(F != nullptr && "Checker is nullptr");
         assert(Checkee != nullptr && "Checkee is nullptr");
 
         auto[undoValues, _patchFunction] = injectGuard(
@@ -345,13 +628,12 @@ struct SCPass : public composition::support::ComposableAnalysis<SCPass> {
 
         // Clang compiler bug otherwise
         auto patchFunction = _patchFunction;
-        auto redo = [Checkee, function_info, &marked_function_count, F,
-            patchFunction, this](const Manifest &m) {
+        auto redo = [Checkee, checkee, sensitive, function_info,
+            &marked_function_count, F, patchFunction, this](const Manifest &m) {
           // This is all for the sake of the stats
           // only collect connectivity info for sensitive functions
-          if (std::find(sensitiveFunctions.begin(), sensitiveFunctions.end(),
-                        Checkee) != sensitiveFunctions.end())
-            ++ProtectedFuncs[Checkee];
+          if (sensitive)
+            ++protectedChecks[checkee];
           // End of stats
           // Note checkees in Function marker pass
           function_info->add_function(Checkee);
@@ -369,18 +651,25 @@ struct SCPass : public composition::support::ComposableAnalysis<SCPass> {
           undoValueSet.insert(u);
         }
 
-        auto m = new Manifest(
-            "sc", Checkee, nullptr, redo,
-            {std::make_unique<graph::constraint::Dependency>("sc", it->first,
-                                                             Checkee),
-             std::make_unique<graph::constraint::Present>("sc", Checkee)},
-            true, undoValueSet, patchInfo);
+        std::vector<std::shared_ptr<graph::constraint::Constraint>>
+            constraints;
+        addGuardConstraints(constraints, F, Checkee);
+        auto m = new Manifest("sc", Checkee, nullptr, redo,
+                              std::move(constraints), true, undoValueSet,
+                              patchInfo);
+        stopPhase(Phase::GuardInjection);
+        startPhase(Phase::ManifestRegistration);
         addProtection(m);
+        stopPhase(Phase::ManifestRegistration);
+        startPhase(Phase::GuardInjection);
 
         didModify = true;
       }
     }
 
+    emitGuardTable(M);
+    stopPhase(Phase::GuardInjection);
+
     // assertFilteredMarked(function_filter_info, countProcessedFuncs,
     // marked_function_count);
     return didModify;
@@ -411,45 +700,221 @@ struct SCPass : public composition::support::ComposableAnalysis<SCPass> {
   }
 
   void dumpStats(const std::vector<Function *> &sensitiveFunctions,
-                 const std::map<Function *, int> &ProtectedFuncs,
+                 const CheckerGraph &graph,
+                 const std::vector<int> &protectedChecks,
                  int numberOfGuards,
                  int numberOfGuardInstructions) { // Do we need to dump stats?
     if (!DumpSCStat.empty()) {
+      startPhase(Phase::StatsComputation);
+      // the guards changed the functions since the cost model counted them
+      instructionCounts.clear();
       // calc number of sensitive instructions
       long sensitiveInsts = 0;
+      long protectedInsts = 0;
+      std::vector<int> frequency;
       for (const auto &function : sensitiveFunctions) {
-        for (BasicBlock &bb : *function) {
-          sensitiveInsts += std::distance(bb.begin(), bb.end());
-        }
+        long instructions = getInstructionCount(function);
+        sensitiveInsts += instructions;
+        protectedInsts += instructions;
+        auto node = graph.lookup(function);
+        frequency.push_back(node == CheckerGraph::NoNode ? 0
+                                                         : protectedChecks[node]);
       }
       stats.setNumberOfSensitiveInstructions(sensitiveInsts);
       stats.addNumberOfGuards(numberOfGuards);
       stats.addNumberOfProtectedFunctions(
-          static_cast<int>(ProtectedFuncs.size()));
+          static_cast<int>(sensitiveFunctions.size()));
       stats.addNumberOfGuardInstructions(numberOfGuardInstructions);
       stats.setDesiredConnectivity(DesiredConnectivity);
-      long protectedInsts = 0;
-      std::vector<int> frequency;
-
-      for (const auto &item : ProtectedFuncs) {
-        const auto &function = item.first;
-        const int frequencyOfChecks = item.second;
-        for (BasicBlock &bb : *function) {
-          protectedInsts += std::distance(bb.begin(), bb.end());
-        }
-        frequency.push_back(frequencyOfChecks);
-      }
       stats.addNumberOfProtectedInstructions(protectedInsts);
       stats.calculateConnectivity(frequency);
       // stats.setAvgConnectivity(actual_connectivity);
       // stats.setStdConnectivity(0);
+      stopPhase(Phase::StatsComputation);
+      recordPhases();
       dbgs() << "SC stats is requested, dumping stat file...\n";
       stats.dumpJson(DumpSCStat.getValue());
     }
   }
 
+  void recordPhases() {
+    for (size_t phase = 0; phase < static_cast<size_t>(Phase::NumPhases);
+         ++phase) {
+      auto &timer = phaseTimers[phase];
+      auto time = timer.getTotalTime();
+      stats.addPhase(PhaseNames[phase], time.getWallTime(), time.getUserTime(),
+                     time.getSystemTime(), phasePeakRss[phase]);
+      // the times are in the stats, keep the timer group from printing them
+      timer.clear();
+    }
+  }
+
+  CallFrequency &getCallFrequency(Module &M) {
+    if (callFrequency.empty()) {
+      callFrequency.compute(M, [this](Function &F) -> BlockFrequencyInfo & {
+        return getAnalysis<BlockFrequencyInfoWrapperPass>(F).getBFI();
+      });
+    }
+    return callFrequency;
+  }
+
+  long getInstructionCount(Function *F) {
+    auto it = instructionCounts.find(F);
+    if (it != instructionCounts.end()) {
+      return it->second;
+    }
+    long count = 0;
+    for (BasicBlock &bb : *F) {
+      count += std::distance(bb.begin(), bb.end());
+    }
+    instructionCounts[F] = count;
+    return count;
+  }
+
+  void setCostModel(Module &M, DAGCheckersNetwork &checkerNetwork,
+                    const std::vector<Function *> &checkees,
+                    const std::vector<Function *> &checkers) {
+    auto &frequency = getCallFrequency(M);
+    std::map<Function *, double> checkerFrequency;
+    std::map<Function *, long> checkeeSize;
+    for (auto *F : checkers) {
+      checkerFrequency[F] = frequency.getFrequency(F);
+    }
+    for (auto *F : checkees) {
+      checkeeSize[F] = getInstructionCount(F);
+    }
+    checkerNetwork.setCostModel(std::move(checkerFrequency),
+                                std::move(checkeeSize));
+  }
+
+  // Reorders sensitiveFunctions so that the ones whose hash matches the cache
+  // come first, in the order the cached network placed them, and pins their
+  // cached checkers. Any checker of a function was placed after it or is not
+  // sensitive, so the pinned checkers are still available when their checkee
+  // is placed again. Leaves the current hashes in the cache.
+  void pinUnchangedCheckers(Module &M, DAGCheckersNetwork &checkerNetwork,
+                            IncrementalCache &cache) {
+    IncrementalCache previous;
+    if (!previous.read(IncrementalCachePath)) {
+      dbgs() << "SCPass: no usable incremental cache at "
+             << IncrementalCachePath << ", placing every function\n";
+      previous = IncrementalCache();
+    }
+    for (auto *F : sensitiveFunctions) {
+      cache.hashes[F->getName().str()] = structuralHash(*F);
+    }
+
+    std::map<Function *, std::vector<Function *>> pinned;
+    std::vector<Function *> order;
+    for (auto &name : previous.order) {
+      Function *F = M.getFunction(name);
+      uint64_t hash;
+      auto current = cache.hashes.find(name);
+      if (!F || pinned.count(F) || current == cache.hashes.end() ||
+          !previous.lookup(name, hash) || hash != current->second) {
+        continue;
+      }
+      auto &checkers = pinned[F];
+      for (auto &checkerName : previous.checkers[name]) {
+        if (Function *checker = M.getFunction(checkerName))
+          checkers.push_back(checker);
+      }
+      order.push_back(F);
+    }
+    size_t reused = order.size();
+    // new and changed functions keep their shuffled order
+    for (auto *F : sensitiveFunctions) {
+      if (!pinned.count(F))
+        order.push_back(F);
+    }
+    sensitiveFunctions = std::move(order);
+    dbgs() << "SCPass: incremental cache reuses the checkers of " << reused
+           << " functions, " << sensitiveFunctions.size() - reused
+           << " functions are placed anew\n";
+    checkerNetwork.setPinnedCheckers(std::move(pinned));
+  }
+
+  void saveIncrementalCache(const DAGCheckersNetwork &checkerNetwork,
+                            IncrementalCache &cache) {
+    for (auto *F : checkerNetwork.getCheckeeOrder()) {
+      cache.order.push_back(F->getName().str());
+      auto &checkers = cache.checkers[F->getName().str()];
+      auto node = checkerGraph.lookup(F);
+      if (node == CheckerGraph::NoNode)
+        continue;
+      for (auto checker : checkerGraph.checkers(node))
+        checkers.push_back(checkerGraph.function(checker)->getName().str());
+    }
+    if (!cache.write(IncrementalCachePath)) {
+      errs() << "SCPass: could not write the incremental cache to "
+             << IncrementalCachePath << "\n";
+    }
+  }
+
+  // -sc-max-guard-frequency: hot functions pay for their guards on every
+  // call, they are removed from the checker candidates
+  void excludeHotCheckers(Module &M, std::vector<Function *> &checkers) {
+    auto &frequency = getCallFrequency(M);
+    checkers.erase(
+        std::remove_if(checkers.begin(), checkers.end(),
+                       [&frequency](Function *F) {
+                         if (frequency.getFrequency(F) <= MaxGuardFrequency)
+                           return false;
+                         dbgs() << "Excluding hot function " << F->getName()
+                                << " (" << frequency.getFrequency(F)
+                                << ") from the checkers\n";
+                         return true;
+                       }),
+        checkers.end());
+  }
+
+  // -sc-cold-placement: the least frequently executed block of F that still
+  // runs. EH pads and blocks ending in unreachable are skipped, and with
+  // profile counts so are blocks the profile never reached.
+  BasicBlock *selectGuardBlock(Function *F) {
+    BasicBlock *coldest = &F->getEntryBlock();
+    if (!ColdPlacement) {
+      return coldest;
+    }
+    auto &BFI = getAnalysis<BlockFrequencyInfoWrapperPass>(*F).getBFI();
+    const bool hasProfile = F->getEntryCount().hasValue();
+    auto frequencyOf = [&BFI, hasProfile](BasicBlock *BB) -> uint64_t {
+      if (hasProfile) {
+        auto count = BFI.getBlockProfileCount(BB);
+        return count.hasValue() ? count.getValue() : 0;
+      }
+      return BFI.getBlockFreq(BB).getFrequency();
+    };
+    uint64_t coldestFrequency = frequencyOf(coldest);
+    for (auto &BB : *F) {
+      if (BB.isEHPad() || llvm::isa<UnreachableInst>(BB.getTerminator())) {
+        continue;
+      }
+      uint64_t frequency = frequencyOf(&BB);
+      if (frequency > 0 && frequency < coldestFrequency) {
+        coldest = &BB;
+        coldestFrequency = frequency;
+      }
+    }
+    if (coldest != &F->getEntryBlock()) {
+      dbgs() << "Placing guards of " << F->getName() << " in "
+             << coldest->getName() << " (" << coldestFrequency << ")\n";
+    }
+    return coldest;
+  }
+
+  // Block frequencies feed the call frequency estimate and cold placement,
+  // without these options BFI is not even scheduled
+  static bool usesBlockFrequency() {
+    return MaxGuardFrequency > 0 || ColdPlacement ||
+           NetworkStrategy == DAGCheckersNetwork::Strategy::MinCost;
+  }
+
   void getAnalysisUsage(AnalysisUsage &AU) const override {
     AU.setPreservesAll();
+    if (usesBlockFrequency()) {
+      AU.addRequired<BlockFrequencyInfoWrapperPass>();
+    }
     AU.addRequired<input_dependency::InputDependencyAnalysisPass>();
     AU.addRequired<FunctionMarkerPass>();
     AU.addPreserved<FunctionMarkerPass>();
@@ -465,15 +930,121 @@ struct SCPass : public composition::support::ComposableAnalysis<SCPass> {
     return r;
   }
 
-  void appendToPatchGuide(const unsigned int length, const unsigned int address,
-                          const unsigned int expectedHash,
-                          const std::string &functionName) {
-    FILE *pFile;
-    pFile = fopen("guide.txt", "a");
-    std::string demangled_name = demangle_name(functionName);
-    fprintf(pFile, "%s,%d,%d,%d\n", demangled_name.c_str(), address, length,
-            expectedHash);
-    fclose(pFile);
+  void parseRateLimits() {
+    rateLimitOverrides.clear();
+    for (const auto &limit : RateLimits) {
+      StringRef value(limit);
+      auto eq = value.rfind('=');
+      auto colon = value.rfind(':');
+      unsigned every, intervalUs;
+      if (eq == StringRef::npos || colon == StringRef::npos || colon < eq ||
+          value.slice(eq + 1, colon).getAsInteger(10, every) ||
+          value.substr(colon + 1).getAsInteger(10, intervalUs)) {
+        errs() << "ERR. Malformed -sc-rate-limit " << limit
+               << ", expected checker=every:interval-us\n";
+        exit(1);
+      }
+      rateLimitOverrides[value.substr(0, eq).str()] = {every, intervalUs};
+    }
+  }
+
+  GuardDescriptor makeDescriptor(Function *checker, unsigned int address,
+                                 unsigned int length,
+                                 unsigned int expectedHash) {
+    GuardDescriptor desc{address,    length,          expectedHash,
+                         GuardHashAlgorithm, CheckEvery, CheckIntervalUs,
+                         ChunkBytes};
+    auto limit = rateLimitOverrides.find(checker->getName());
+    if (limit != rateLimitOverrides.end()) {
+      desc.every = limit->second.first;
+      desc.intervalUs = limit->second.second;
+    }
+    return desc;
+  }
+
+  StructType *getGuardDescriptorType(LLVMContext &Ctx) {
+    auto *int32Ty = Type::getInt32Ty(Ctx);
+    return StructType::get(
+        Ctx, {int32Ty, int32Ty, int32Ty, int32Ty, int32Ty, int32Ty, int32Ty});
+  }
+
+  // Defines a global the runtime may already have declared (weak) when rtlib
+  // is linked before the pass, the declaration is replaced
+  GlobalVariable *defineRuntimeGlobal(Module &M, const std::string &name,
+                                      Constant *initializer, bool isConstant) {
+    auto *declared = M.getNamedGlobal(name);
+    auto *global = new GlobalVariable(M, initializer->getType(), isConstant,
+                                      GlobalValue::ExternalLinkage, initializer);
+    if (declared) {
+      declared->replaceAllUsesWith(
+          ConstantExpr::getBitCast(global, declared->getType()));
+      global->takeName(declared);
+      declared->eraseFromParent();
+    } else {
+      global->setName(name);
+    }
+    return global;
+  }
+
+  // Table and batch guards refer to sc_guard_table before its initializer is
+  // known, they get this declaration which emitGuardTable replaces
+  GlobalVariable *getGuardTableDeclaration(Module &M) {
+    if (auto *declared = M.getNamedGlobal(sc_guard_table_str)) {
+      return declared;
+    }
+    auto *descTy = getGuardDescriptorType(M.getContext());
+    return new GlobalVariable(M, ArrayType::get(descTy, 0),
+                              /*isConstant=*/false, GlobalValue::ExternalLinkage,
+                              nullptr, sc_guard_table_str);
+  }
+
+  // Emits sc_guard_table, the descriptors guardMeIdx indexes, and
+  // sc_guard_count, which sizes the per-guard runtime state. Each entry is
+  // {address, length, hash, algorithm, every, interval-us, chunk-bytes}, the
+  // first three still hold the placeholders the patcher replaces. The table
+  // is not constant: it is linked with rtlib before llc, and the optimizer
+  // would fold its loads in guardMeIdx into the placeholders otherwise.
+  // Entries are emitted for every injected guard, also for the ones whose
+  // manifests the composition framework undoes later. Those entries are
+  // never indexed, keep their placeholders and are skipped by SCPatchPass.
+  void emitGuardTable(Module &M) {
+    if (guardDescriptors.empty()) {
+      return;
+    }
+    LLVMContext &Ctx = M.getContext();
+    auto *int32Ty = Type::getInt32Ty(Ctx);
+    auto *descTy = getGuardDescriptorType(Ctx);
+    std::vector<Constant *> entries;
+    entries.reserve(guardDescriptors.size());
+    for (const auto &desc : guardDescriptors) {
+      entries.push_back(ConstantStruct::get(
+          descTy, {ConstantInt::get(int32Ty, desc.address),
+                   ConstantInt::get(int32Ty, desc.length),
+                   ConstantInt::get(int32Ty, desc.expectedHash),
+                   ConstantInt::get(int32Ty, static_cast<uint64_t>(desc.hash)),
+                   ConstantInt::get(int32Ty, desc.every),
+                   ConstantInt::get(int32Ty, desc.intervalUs),
+                   ConstantInt::get(int32Ty, desc.chunkBytes)}));
+    }
+    auto *tableTy = ArrayType::get(descTy, entries.size());
+    defineRuntimeGlobal(M, sc_guard_table_str,
+                        ConstantArray::get(tableTy, entries),
+                        /*isConstant=*/false);
+    defineRuntimeGlobal(M, "sc_guard_count",
+                        ConstantInt::get(int32Ty, entries.size()),
+                        /*isConstant=*/true);
+    dbgs() << "Emitted " << entries.size() << " guard descriptors\n";
+  }
+
+  // Constraints of a guard in checker on checkee, the same for single and
+  // batched guards: the checker depends on the checkee, which has to stay
+  void addGuardConstraints(
+      std::vector<std::shared_ptr<graph::constraint::Constraint>> &constraints,
+      Function *checker, Function *checkee) {
+    constraints.push_back(
+        std::make_shared<graph::constraint::Dependency>("sc", checker, checkee));
+    constraints.push_back(
+        std::make_shared<graph::constraint::Present>("sc", checkee));
   }
 
   void setPatchMetadata(Instruction *Inst, const std::string &tag) {
@@ -566,8 +1137,15 @@ struct SCPass : public composition::support::ComposableAnalysis<SCPass> {
 
 
 //            注意，这个方法并不会生成函数的实际定义体（即函数的具体实现），它只是在模块中声明了一个函数。如果需要为函数生成实际的定义体，需要在其他地方进行函数的定义和实现。
-Constant *guardFunc = BB->getParent()->getParent()->getOrInsertFunction(
-        "guardMe", function_type);// todo 这个函数有谁调用
+    Module *M = BB->getParent()->getParent();
+    Constant *guardFunc =
+        useTable
+            ? M->getOrInsertFunction(
+                  "guardMeIdx",
+                  llvm::FunctionType::get(llvm::Type::getVoidTy(Ctx),
+                                          {Type::getInt32Ty(Ctx)}, false))
+            : M->getOrInsertFunction(guardHashEntryPoint(GuardHashAlgorithm),
+                                     function_type); // todo 这个函数有谁调用
 
     IRBuilder<> builder(I);
     auto insertPoint = ++builder.GetInsertPoint();
@@ -580,57 +1158,86 @@ Constant *guardFunc = BB->getParent()->getParent()->getOrInsertFunction(
     unsigned int expectedHash = expected_hash_begin++;
 
     std::vector<llvm::Value *> args;
-
-    auto *arg1 = llvm::ConstantInt::get(llvm::Type::getInt32Ty(Ctx), address);
-    auto *arg2 = llvm::ConstantInt::get(llvm::Type::getInt32Ty(Ctx), length);
-    auto *arg3 =
-        llvm::ConstantInt::get(llvm::Type::getInt32Ty(Ctx), expectedHash);
-
     std::vector<llvm::Value *> undoValues{};
-
-    undoValues.push_back(arg1);
-    undoValues.push_back(arg2);
-    undoValues.push_back(arg3);
+    // constants no other pass may touch before the patcher fills them in
+    std::vector<llvm::Value *> preservedValues{};
+    int tableIndex = -1;
     int localGuardInstructions;
-    if (is_in_inputdep) {
-      args.push_back(arg1);
-      args.push_back(arg2);
-      args.push_back(arg3);
+
+    if (useTable) {
+      // the placeholders live in sc_guard_table, the call only carries the
+      // index of the descriptor
+      tableIndex = static_cast<int>(guardDescriptors.size());
+      guardDescriptors.push_back(
+          makeDescriptor(BB->getParent(), address, length, expectedHash));
+      auto *id = llvm::ConstantInt::get(llvm::Type::getInt32Ty(Ctx),
+                                        static_cast<uint64_t>(tableIndex));
+      args.push_back(id);
+      undoValues.push_back(id);
+      preservedValues.push_back(id);
       localGuardInstructions = 1;
     } else {
-      auto *A = builder.CreateAlloca(Type::getInt32Ty(Ctx), nullptr, "a");
-      auto *B = builder.CreateAlloca(Type::getInt32Ty(Ctx), nullptr, "b");
-      auto *C = builder.CreateAlloca(Type::getInt32Ty(Ctx), nullptr, "c");
-      auto *store1 = builder.CreateStore(arg1, A, /*isVolatile=*/false);
-      store1->setMetadata(sc_guard_str, sc_guard_md);
-      // setPatchMetadata(store1, "address");
-      auto *store2 = builder.CreateStore(arg2, B, /*isVolatile=*/false);
-      store2->setMetadata(sc_guard_str, sc_guard_md);
-      // setPatchMetadata(store2, "length");
-      auto *store3 = builder.CreateStore(arg3, C, /*isVolatile=*/false);
-      store3->setMetadata(sc_guard_str, sc_guard_md);
-      // setPatchMetadata(store3, "hash");
-      auto *load1 = builder.CreateLoad(A);
-      load1->setMetadata(sc_guard_str, sc_guard_md);
-      auto *load2 = builder.CreateLoad(B);
-      load2->setMetadata(sc_guard_str, sc_guard_md);
-      auto *load3 = builder.CreateLoad(C);
-      load3->setMetadata(sc_guard_str, sc_guard_md);
-      args.push_back(load1);
-      args.push_back(load2);
-      args.push_back(load3);
-
-      undoValues.push_back(A);
-      undoValues.push_back(B);
-      undoValues.push_back(C);
-      undoValues.push_back(store1);
-      undoValues.push_back(store2);
-      undoValues.push_back(store3);
-      undoValues.push_back(load1);
-      undoValues.push_back(load2);
-      undoValues.push_back(load3);
-
-      localGuardInstructions = 9;
+      auto *arg1 =
+          llvm::ConstantInt::get(llvm::Type::getInt32Ty(Ctx), address);
+      auto *arg2 =
+          llvm::ConstantInt::get(llvm::Type::getInt32Ty(Ctx), length);
+      auto *arg3 =
+          llvm::ConstantInt::get(llvm::Type::getInt32Ty(Ctx), expectedHash);
+
+      undoValues.push_back(arg1);
+      undoValues.push_back(arg2);
+      undoValues.push_back(arg3);
+      preservedValues.push_back(arg1);
+      preservedValues.push_back(arg2);
+      preservedValues.push_back(arg3);
+      if (is_in_inputdep) {
+        args.push_back(arg1);
+        args.push_back(arg2);
+        args.push_back(arg3);
+        localGuardInstructions = 1;
+      } else {
+        // guards placed outside the entry block (-sc-cold-placement) keep
+        // their allocas static
+        auto &entryBlock = BB->getParent()->getEntryBlock();
+        IRBuilder<> entryBuilder(&*entryBlock.getFirstInsertionPt());
+        auto &allocaBuilder = BB == &entryBlock ? builder : entryBuilder;
+        auto *A =
+            allocaBuilder.CreateAlloca(Type::getInt32Ty(Ctx), nullptr, "a");
+        auto *B =
+            allocaBuilder.CreateAlloca(Type::getInt32Ty(Ctx), nullptr, "b");
+        auto *C =
+            allocaBuilder.CreateAlloca(Type::getInt32Ty(Ctx), nullptr, "c");
+        auto *store1 = builder.CreateStore(arg1, A, /*isVolatile=*/false);
+        store1->setMetadata(sc_guard_str, sc_guard_md);
+        // setPatchMetadata(store1, "address");
+        auto *store2 = builder.CreateStore(arg2, B, /*isVolatile=*/false);
+        store2->setMetadata(sc_guard_str, sc_guard_md);
+        // setPatchMetadata(store2, "length");
+        auto *store3 = builder.CreateStore(arg3, C, /*isVolatile=*/false);
+        store3->setMetadata(sc_guard_str, sc_guard_md);
+        // setPatchMetadata(store3, "hash");
+        auto *load1 = builder.CreateLoad(A);
+        load1->setMetadata(sc_guard_str, sc_guard_md);
+        auto *load2 = builder.CreateLoad(B);
+        load2->setMetadata(sc_guard_str, sc_guard_md);
+        auto *load3 = builder.CreateLoad(C);
+        load3->setMetadata(sc_guard_str, sc_guard_md);
+        args.push_back(load1);
+        args.push_back(load2);
+        args.push_back(load3);
+
+        undoValues.push_back(A);
+        undoValues.push_back(B);
+        undoValues.push_back(C);
+        undoValues.push_back(store1);
+        undoValues.push_back(store2);
+        undoValues.push_back(store3);
+        undoValues.push_back(load1);
+        undoValues.push_back(load2);
+        undoValues.push_back(load3);
+
+        localGuardInstructions = 9;
+      }
     }
 
     CallInst *call = builder.CreateCall(guardFunc, args);
@@ -639,27 +1246,27 @@ Constant *guardFunc = BB->getParent()->getParent()->getOrInsertFunction(
     setPatchMetadata(call, Checkee->getName());
     // Stats: we assume the call instrucion and its arguments account for one
     // instruction
-    std::ostringstream patchInfoStream{};
-    std::string demangled_name = demangle_name(Checkee->getName());
-    patchInfoStream << demangled_name.c_str() << "," << address << "," << length
-                    << "," << expectedHash << "\n";
-    patchInfo = patchInfoStream.str();
-
-    auto patchFunction = [length, address, expectedHash, arg1, arg2, arg3,
-        localGuardInstructions, &numberOfGuardInstructions,
+    GuardPatch guidePatch;
+    guidePatch.function = patchGuide.guideName(Checkee->getName());
+    guidePatch.addressPlaceholder = address;
+    guidePatch.sizePlaceholder = length;
+    guidePatch.hashPlaceholder = expectedHash;
+    guidePatch.hash = GuardHashAlgorithm;
+    guidePatch.tableIndex = tableIndex;
+    patchInfo = formatPatchGuideLine(guidePatch) + "\n";
+
+    auto patchFunction = [length, address, expectedHash, tableIndex,
+        preservedValues, localGuardInstructions, &numberOfGuardInstructions,
         Checkee, this](const Manifest &m) {
       dbgs() << "placeholder:" << address << " size:" << length
              << " expected hash:" << expectedHash << "\n";
-      appendToPatchGuide(length, address, expectedHash, Checkee->getName());
-      addPreserved("sc", arg1,
-                   [this](const std::string &pass, llvm::Value *oldV,
-                          llvm::Value *newV) { assert(false); });
-      addPreserved("sc", arg2,
-                   [this](const std::string &pass, llvm::Value *oldV,
-                          llvm::Value *newV) { assert(false); });
-      addPreserved("sc", arg3,
-                   [this](const std::string &pass, llvm::Value *oldV,
-                          llvm::Value *newV) { assert(false); });
+      patchGuide.add(Checkee->getName(), address, length, expectedHash,
+                     GuardHashAlgorithm, tableIndex);
+      for (auto *preserved : preservedValues) {
+        addPreserved("sc", preserved,
+                     [this](const std::string &pass, llvm::Value *oldV,
+                            llvm::Value *newV) { assert(false); });
+      }
       numberOfGuardInstructions += localGuardInstructions;
       Checkee->addFnAttr(llvm::Attribute::NoInline);
     };
@@ -667,6 +1274,91 @@ Constant *guardFunc = BB->getParent()->getParent()->getOrInsertFunction(
     return {undoValues, patchFunction};
   }
 
+  // Batch mode (-sc-batch-guards): the checkees of one checker get
+  // consecutive descriptors in sc_guard_table and a single
+  // guardMeBatch(&sc_guard_table[first], n) call checks all of them.
+  std::pair<std::vector<llvm::Value *>, PatchFunction>
+  injectBatchGuard(BasicBlock *BB, Instruction *I,
+                   const std::vector<Function *> &checkees,
+                   int &numberOfGuardInstructions) {
+    LLVMContext &Ctx = BB->getParent()->getContext();
+    Module *M = BB->getParent()->getParent();
+    auto *int32Ty = Type::getInt32Ty(Ctx);
+    auto *descPtrTy = Type::getInt8PtrTy(Ctx);
+    Constant *batchFunc = M->getOrInsertFunction(
+        "guardMeBatch",
+        llvm::FunctionType::get(llvm::Type::getVoidTy(Ctx),
+                                {descPtrTy, int32Ty}, false));
+
+    IRBuilder<> builder(I);
+    auto insertPoint = ++builder.GetInsertPoint();
+    if (llvm::isa<TerminatorInst>(I)) {
+      insertPoint--;
+    }
+    builder.SetInsertPoint(BB, insertPoint);
+
+    struct BatchEntry {
+      Function *checkee;
+      unsigned int address;
+      unsigned int length;
+      unsigned int expectedHash;
+      int tableIndex;
+    };
+    std::vector<BatchEntry> entries;
+    std::ostringstream patchInfoStream{};
+    const auto first = static_cast<uint64_t>(guardDescriptors.size());
+    for (auto *Checkee : checkees) {
+      BatchEntry entry{Checkee, address_begin++, size_begin++,
+                       expected_hash_begin++,
+                       static_cast<int>(guardDescriptors.size())};
+      guardDescriptors.push_back(makeDescriptor(
+          BB->getParent(), entry.address, entry.length, entry.expectedHash));
+      GuardPatch guidePatch;
+      guidePatch.function = patchGuide.guideName(Checkee->getName());
+      guidePatch.addressPlaceholder = entry.address;
+      guidePatch.sizePlaceholder = entry.length;
+      guidePatch.hashPlaceholder = entry.expectedHash;
+      guidePatch.hash = GuardHashAlgorithm;
+      guidePatch.tableIndex = entry.tableIndex;
+      patchInfoStream << formatPatchGuideLine(guidePatch) << "\n";
+      entries.push_back(entry);
+    }
+    patchInfo = patchInfoStream.str();
+
+    auto *table = getGuardTableDeclaration(*M);
+    Constant *indices[] = {ConstantInt::get(int32Ty, 0),
+                           ConstantInt::get(int32Ty, first)};
+    auto *descs = ConstantExpr::getBitCast(
+        ConstantExpr::getGetElementPtr(table->getValueType(), table, indices),
+        descPtrTy);
+    auto *count = ConstantInt::get(int32Ty, entries.size());
+    CallInst *call = builder.CreateCall(batchFunc, {descs, count});
+    call->setMetadata(sc_guard_str, sc_guard_md);
+
+    std::vector<llvm::Value *> undoValues{descs, count, call};
+    std::vector<llvm::Value *> preservedValues{descs, count};
+    auto patchFunction = [entries, preservedValues, &numberOfGuardInstructions,
+        this](const Manifest &m) {
+      for (const auto &entry : entries) {
+        dbgs() << "placeholder:" << entry.address << " size:" << entry.length
+               << " expected hash:" << entry.expectedHash << "\n";
+        patchGuide.add(entry.checkee->getName(), entry.address, entry.length,
+                       entry.expectedHash, GuardHashAlgorithm,
+                       entry.tableIndex);
+        entry.checkee->addFnAttr(llvm::Attribute::NoInline);
+      }
+      for (auto *preserved : preservedValues) {
+        addPreserved("sc", preserved,
+                     [this](const std::string &pass, llvm::Value *oldV,
+                            llvm::Value *newV) { assert(false); });
+      }
+      // Stats: one call covers the whole batch
+      numberOfGuardInstructions += 1;
+    };
+
+    return {undoValues, patchFunction};
+  }
+
   std::string patchInfo;
 };
 } // namespace
@@ -674,7 +1366,18 @@ Constant *guardFunc = BB->getParent()->getParent()->getOrInsertFunction(
 char SCPass::ID = 0;
 
 bool SCPass::doFinalization(Module &module) {
-  dumpStats(sensitiveFunctions, ProtectedFuncs, numberOfGuards,
+  // A module without guards leaves an existing guide untouched
+  if (patchGuide.size() > 0) {
+    startPhase(Phase::PatchGuideWrite);
+    if (!patchGuide.write(PatchGuidePath, PatchGuideFormatOpt)) {
+      errs() << "ERR. Failed to write the patch guide to " << PatchGuidePath
+             << "\n";
+    }
+    stopPhase(Phase::PatchGuideWrite);
+    dbgs() << "Wrote " << patchGuide.size() << " entries to the patch guide "
+           << PatchGuidePath << "\n";
+  }
+  dumpStats(sensitiveFunctions, checkerGraph, protectedChecks, numberOfGuards,
             numberOfGuardInstructions);
 
   return ModulePass::doFinalization(module);
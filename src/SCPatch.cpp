@@ -1,3 +1,4 @@
+#include "self-checksumming/GuardHash.h"
 #include "self-checksumming/PatchManifest.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
@@ -6,6 +7,7 @@
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
@@ -14,75 +16,141 @@
 #include <stdint.h>
 using namespace llvm;
 
+static cl::opt<std::string> PatchManifestPath(
+    "sc-patch-manifest", cl::Hidden, cl::init("patch_guide"),
+    cl::desc("Patch manifest written by the patcher, JSON or binary"));
+
 namespace {
 struct SCPatchPass : public ModulePass {
   static char ID;
 
   SCPatchPass() : ModulePass(ID) {}
 
+  // Guards are found through the use lists of the rtlib entry points and the
+  // sc_guard_table initializer, so patching costs O(number of guards) and
+  // never walks the instructions of the module.
   bool runOnModule(Module &M) override {
     bool didModify = false;
     PatchManifest patchManifest;
-    // TODO: get manifest name from command line arguments
-    patchManifest.readPatchManifest("patch_guide");
-//      for (auto &F : M)：外层循环遍历 Module M 中的每个函数 F。
-//      for (auto &B : F)：中层循环遍历每个函数 F 中的每个基本块 B。
-//      for (auto &I : B)：内层循环遍历每个基本块 B 中的每条指令 I。
-    for (auto &F : M) {
-      for (auto &B : F) {
-        for (auto &I : B) {
-          if (I.getMetadata("address")) {
-            didModify = patchStore(&I, (patchManifest.address_patches),
-                /*16bit*/ false);
-            // dbgs()<<"patching address\n";
-          } else if (I.getMetadata("length")) {
-            didModify =
-                patchStore(&I, (patchManifest.size_patches), /*16bit*/ true);
-            // dbgs()<<"patching size\n";
-          } else if (I.getMetadata("hash")) {
-            didModify =
-                patchStore(&I, (patchManifest.hash_patches), /*16bit*/ false);
-            // dbgs()<<"patching hash\n";
-          }
-          /*if (auto *callInst = llvm::dyn_cast<llvm::CallInst>(&I)) {
-                  auto calledF = callInst->getCalledFunction();
-                  if (calledF && calledF->getName() == "guardMe") {
-                          patchGuard(callInst, &patchManifest);
-                          didModify = true;
-                  }
-          }*/
+    if (!patchManifest.readPatchManifest(PatchManifestPath)) {
+      return false;
+    }
+    for (auto hash : {GuardHash::XOR, GuardHash::CRC32C, GuardHash::Adler32,
+                      GuardHash::Mix64}) {
+      Function *entryPoint = M.getFunction(guardHashEntryPoint(hash));
+      if (!entryPoint) {
+        continue;
+      }
+      for (User *user : entryPoint->users()) {
+        auto *call = dyn_cast<CallInst>(user);
+        if (call && call->getMetadata("sc_guard")) {
+          didModify |= patchGuardCall(call, patchManifest);
         }
       }
     }
+    didModify |= patchGuardTable(M, patchManifest);
     return didModify;
   }
 
-  bool patchStore(Instruction *I, std::map<int, int> lookupMap, bool is16bit) {
-    llvm::LLVMContext &Ctx = I->getModule()->getContext();
-    llvm::IRBuilder<> builder(I);
-    builder.SetInsertPoint(I->getParent(), builder.GetInsertPoint());
-    if (auto *store = dyn_cast<StoreInst>(I)) {
-      Value *v = store->getValueOperand();
-      if (auto *CI = dyn_cast<ConstantInt>(v)) {
-        int placeholder = static_cast<int>(CI->getSExtValue());
-        int patch = lookupMap[placeholder];
-        Value *valueToPatch;
-        if (is16bit) {
-          valueToPatch = builder.getInt16(static_cast<uint16_t>(patch));
-        } else {
-          valueToPatch = builder.getInt32(static_cast<uint32_t>(patch));
+  // guardMe*(address, length, expectedHash): each argument is either the
+  // placeholder itself or a load of an alloca the placeholder is stored to
+  bool patchGuardCall(CallInst *call, const PatchManifest &patchManifest) {
+    const PatchManifest::Kind kinds[] = {
+        PatchManifest::Address, PatchManifest::Size, PatchManifest::Hash};
+    bool didModify = false;
+    for (unsigned i = 0; i < 3 && i < call->getNumArgOperands(); ++i) {
+      Value *arg = call->getArgOperand(i);
+      if (auto *CI = dyn_cast<ConstantInt>(arg)) {
+        call->setArgOperand(i, patchConstant(CI, patchManifest, kinds[i]));
+        didModify = true;
+        continue;
+      }
+      auto *load = dyn_cast<LoadInst>(arg);
+      auto *slot =
+          load ? dyn_cast<AllocaInst>(load->getPointerOperand()) : nullptr;
+      if (!slot) {
+        continue;
+      }
+      for (User *slotUser : slot->users()) {
+        auto *store = dyn_cast<StoreInst>(slotUser);
+        if (store && store->getPointerOperand() == slot &&
+            store->getMetadata("sc_guard")) {
+          didModify |= patchStore(store, patchManifest, kinds[i]);
         }
-        valueToPatch->print(dbgs(), true);
-        dbgs() << "\n";
-        store->setOperand(0, valueToPatch);
-        store->print(dbgs(), true);
-        dbgs() << "\n";
-        return true;
-      } else {
-        assert(false);
       }
+    }
+    return didModify;
+  }
+
+  // Table and batch guards keep their placeholders in the first three fields
+  // of every sc_guard_table descriptor. Descriptors whose address placeholder
+  // is not in the manifest belong to guards whose manifests were undone, no
+  // guard uses them and they are left as they are.
+  bool patchGuardTable(Module &M, const PatchManifest &patchManifest) {
+    GlobalVariable *table = M.getNamedGlobal("sc_guard_table");
+    if (!table || !table->hasInitializer()) {
+      return false;
+    }
+    auto *descriptors = dyn_cast<ConstantArray>(table->getInitializer());
+    if (!descriptors) {
+      return false;
+    }
+    const PatchManifest::Kind kinds[] = {
+        PatchManifest::Address, PatchManifest::Size, PatchManifest::Hash};
+    std::vector<Constant *> patched;
+    patched.reserve(descriptors->getNumOperands());
+    for (auto &operand : descriptors->operands()) {
+      auto *descriptor = cast<ConstantStruct>(operand);
+      auto *address = dyn_cast<ConstantInt>(descriptor->getOperand(0));
+      uint32_t unused;
+      if (!address ||
+          !patchManifest.lookup(
+              PatchManifest::Address,
+              static_cast<uint32_t>(address->getZExtValue()), unused)) {
+        patched.push_back(descriptor);
+        continue;
+      }
+      std::vector<Constant *> fields;
+      for (unsigned i = 0; i < descriptor->getNumOperands(); ++i) {
+        auto *field = descriptor->getOperand(i);
+        auto *CI = dyn_cast<ConstantInt>(field);
+        fields.push_back(i < 3 && CI ? patchConstant(CI, patchManifest,
+                                                     kinds[i])
+                                     : field);
+      }
+      patched.push_back(ConstantStruct::get(descriptor->getType(), fields));
+    }
+    table->setInitializer(ConstantArray::get(descriptors->getType(), patched));
+    return true;
+  }
+
+  ConstantInt *patchConstant(ConstantInt *CI,
+                             const PatchManifest &patchManifest,
+                             PatchManifest::Kind kind) {
+    auto placeholder = static_cast<uint32_t>(CI->getZExtValue());
+    uint32_t patch = 0;
+    // the guard is still in the IR, so its manifest was applied and the
+    // patcher has to know the placeholder. Patching it with 0 would turn it
+    // into a check of an empty region that always passes.
+    if (!patchManifest.lookup(kind, placeholder, patch)) {
+      errs() << "ERR. Placeholder " << placeholder
+             << " is not in the patch manifest " << PatchManifestPath << "\n";
+      exit(1);
+    }
+    // keep the width of the patched value, lengths used to be stored as i16
+    return ConstantInt::get(CI->getType(), patch);
+  }
+
+  bool patchStore(StoreInst *store, const PatchManifest &patchManifest,
+                  PatchManifest::Kind kind) {
+    auto *CI = dyn_cast<ConstantInt>(store->getValueOperand());
+    if (!CI) {
       return false;
     }
+    store->setOperand(0, patchConstant(CI, patchManifest, kind));
+    store->print(dbgs(), true);
+    dbgs() << "\n";
+    return true;
   }
 
   void getAnalysisUsage(AnalysisUsage &AU) const override {}
@@ -0,0 +1,577 @@
+// sc-patcher: patches the placeholders SCPass left in a linked binary with the
+// checkee addresses, sizes and expected hashes. Native replacement of
+// patcher/dump_pipe.py, it reads function offsets and sizes from the ELF
+// symbol table instead of a radare2 analysis and hashes straight from the
+// mmapped file. Usage and outputs are the same:
+//   sc-patcher <binary> <guide.txt> [patch_guide] [sc.stats]
+#include "self-checksumming/GuardHash.h"
+#include "self-checksumming/PatchGuide.h"
+#include "self-checksumming/PatchManifest.h"
+#include "nlohmann/json.hpp"
+#include "llvm/Object/ELFObjectFile.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <map>
+#include <tuple>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace llvm;
+
+static cl::opt<std::string> BinaryPath(cl::Positional, cl::Required,
+                                       cl::desc("<binary>"));
+static cl::opt<std::string> GuidePath(cl::Positional, cl::Required,
+                                      cl::desc("<guide.txt>"));
+static cl::opt<std::string>
+    DumpPath(cl::Positional, cl::desc("[dump_computed_patches.json]"));
+static cl::opt<std::string> StatsPath(cl::Positional, cl::desc("[sc.stats]"));
+
+static cl::opt<bool> BinaryManifest(
+    "binary-manifest",
+    cl::desc("Dump the computed patches as a binary PatchManifest instead of "
+             "JSON"));
+
+static cl::opt<unsigned>
+    Threads("j", cl::init(std::max(1u, std::thread::hardware_concurrency())),
+            cl::desc("Number of threads scanning the binary"));
+
+static cl::opt<bool> DebugPatches("debug-patches",
+                                  cl::desc("Print every patch applied"));
+
+namespace {
+// sc_guard_table entries, see struct sc_guard_desc in rtlib.c
+constexpr size_t GuardDescSize = 28;
+
+struct FunctionInfo {
+  uint64_t address;
+  uint64_t size;
+};
+
+struct SectionInfo {
+  uint64_t address;
+  uint64_t size;
+  uint64_t offset;
+};
+
+// The binary mapped read-write, patches land in the file directly
+class BinaryImage {
+public:
+  ~BinaryImage() {
+    if (data != MAP_FAILED) {
+      msync(data, size, MS_SYNC);
+      munmap(data, size);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  bool open(const std::string &path) {
+    fd = ::open(path.c_str(), O_RDWR);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      errs() << "ERR. Cannot open " << path << "\n";
+      return false;
+    }
+    size = static_cast<size_t>(st.st_size);
+    data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+      errs() << "ERR. Cannot map " << path << "\n";
+      return false;
+    }
+    return readObject(path);
+  }
+
+  uint8_t *bytes() { return static_cast<uint8_t *>(data); }
+  size_t fileSize() const { return size; }
+
+  const FunctionInfo *findFunction(const std::string &name) const {
+    auto it = functions.find(name);
+    return it == functions.end() ? nullptr : &it->second;
+  }
+
+  // File bytes backing [address, address + length) of the loaded image
+  const uint8_t *atAddress(uint64_t address, uint64_t length) {
+    for (const auto &section : sections) {
+      if (address >= section.address &&
+          address + length <= section.address + section.size) {
+        return bytes() + section.offset + (address - section.address);
+      }
+    }
+    return nullptr;
+  }
+
+private:
+  bool readObject(const std::string &path) {
+    MemoryBufferRef buffer(
+        StringRef(static_cast<const char *>(data), size), path);
+    auto objOrErr = object::ObjectFile::createObjectFile(buffer);
+    if (!objOrErr) {
+      errs() << "ERR. " << path << ": " << toString(objOrErr.takeError())
+             << "\n";
+      return false;
+    }
+    auto *elf = dyn_cast<object::ELFObjectFileBase>(objOrErr->get());
+    if (!elf) {
+      errs() << "ERR. " << path << " is not an ELF file\n";
+      return false;
+    }
+    for (const object::SectionRef &section : elf->sections()) {
+      object::ELFSectionRef elfSection(section);
+      if (elfSection.getType() == ELF::SHT_NOBITS || !section.getAddress()) {
+        continue;
+      }
+      sections.push_back(
+          {section.getAddress(), section.getSize(), elfSection.getOffset()});
+    }
+    for (const auto &symbolAndSize : object::computeSymbolSizes(*elf)) {
+      const object::SymbolRef &symbol = symbolAndSize.first;
+      auto type = symbol.getType();
+      auto name = symbol.getName();
+      auto address = symbol.getAddress();
+      if (!type || !name || !address) {
+        consumeError(type.takeError());
+        consumeError(name.takeError());
+        consumeError(address.takeError());
+        continue;
+      }
+      if (*type != object::SymbolRef::ST_Function || !symbolAndSize.second) {
+        continue;
+      }
+      FunctionInfo info{*address, symbolAndSize.second};
+      // the guide records demangled names, keep both spellings
+      functions.emplace(name->str(), info);
+      functions.emplace(demangle_name(name->str()), info);
+    }
+    return true;
+  }
+
+  int fd = -1;
+  void *data = MAP_FAILED;
+  size_t size = 0;
+  std::map<std::string, FunctionInfo> functions;
+  std::vector<SectionInfo> sections;
+};
+
+struct Patch {
+  GuardPatch guide;
+  uint64_t addressTarget;
+  uint64_t sizeTarget;
+  uint32_t hashTarget = 0;
+  size_t region = 0;
+  // file offsets of the hash placeholder
+  std::vector<size_t> hashOffsets;
+};
+
+// A checkee hashed with one algorithm. Guards of the same checkee share the
+// region, so every function is hashed once per algorithm regardless of the
+// connectivity.
+struct HashRegion {
+  uint64_t address;
+  uint64_t size;
+  GuardHash hash;
+  size_t fileOffset;
+  uint32_t result = 0;
+  bool done = false;
+  // regions containing a hash placeholder of one of this region's guards
+  std::vector<size_t> dependents;
+  // hash placeholders inside this region that are not patched yet
+  size_t pendingPlaceholders = 0;
+  std::vector<size_t> patches;
+};
+
+void writeU32(uint8_t *at, uint32_t value) { std::memcpy(at, &value, 4); }
+
+uint32_t readU32(const uint8_t *at) {
+  uint32_t value;
+  std::memcpy(&value, at, 4);
+  return value;
+}
+
+// Runs body(part) for part in [0, parts) on up to `threads` threads
+template <typename Body>
+void parallelFor(size_t parts, unsigned threads, const Body &body) {
+  std::atomic<size_t> next{0};
+  auto worker = [&]() {
+    for (size_t part; (part = next.fetch_add(1)) < parts;) {
+      body(part);
+    }
+  };
+  std::vector<std::thread> workers;
+  for (unsigned i = 1; i < std::min<size_t>(threads, parts); ++i) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto &thread : workers) {
+    thread.join();
+  }
+}
+
+// Offsets of every occurrence of the placeholder values in the file, found in
+// a single pass that is split across threads by file range. Every offset is
+// first tested against a bitmap of the sought values' upper half-words, only
+// candidates are looked up in the sorted value list, so the scan costs the
+// same for ten guards as for a hundred thousand.
+std::map<uint32_t, std::vector<size_t>>
+findAllPlaceholders(const uint8_t *data, size_t size,
+                    std::vector<uint32_t> values, unsigned threads) {
+  std::sort(values.begin(), values.end());
+  values.erase(std::unique(values.begin(), values.end()), values.end());
+  std::vector<uint64_t> highHalves(65536 / 64);
+  for (uint32_t value : values) {
+    highHalves[(value >> 16) / 64] |= uint64_t(1) << ((value >> 16) % 64);
+  }
+
+  using Match = std::pair<uint32_t, size_t>;
+  size_t positions = size < 4 ? 0 : size - 3;
+  threads = std::max(1u, std::min<unsigned>(threads, positions / 65536 + 1));
+  std::vector<std::vector<Match>> matches(threads);
+  parallelFor(threads, threads, [&](size_t part) {
+    size_t begin = positions * part / threads;
+    size_t end = positions * (part + 1) / threads;
+    for (size_t offset = begin; offset < end; ++offset) {
+      uint32_t high = data[offset + 2] | (data[offset + 3] << 8);
+      if (!(highHalves[high / 64] & (uint64_t(1) << (high % 64)))) {
+        continue;
+      }
+      uint32_t word = readU32(data + offset);
+      if (std::binary_search(values.begin(), values.end(), word)) {
+        matches[part].push_back({word, offset});
+      }
+    }
+  });
+
+  std::map<uint32_t, std::vector<size_t>> found;
+  for (uint32_t value : values) {
+    found[value];
+  }
+  for (const auto &partMatches : matches) {
+    for (const auto &match : partMatches) {
+      found[match.first].push_back(match.second);
+    }
+  }
+  return found;
+}
+
+// One search locates the whole table, every other descriptor sits at a fixed
+// offset from the one we look for
+long findGuardTable(const uint8_t *data, size_t size, const Patch &first) {
+  uint8_t pattern[12];
+  writeU32(pattern, first.guide.addressPlaceholder);
+  writeU32(pattern + 4, first.guide.sizePlaceholder);
+  writeU32(pattern + 8, first.guide.hashPlaceholder);
+  const auto *at = static_cast<const uint8_t *>(
+      memmem(data, size, pattern, sizeof(pattern)));
+  if (!at) {
+    errs() << "ERR. Failed to find the guard table in the binary\n";
+    return -1;
+  }
+  if (memmem(at + 1, data + size - at - 1, pattern, sizeof(pattern))) {
+    errs() << "ERR. Guard descriptor " << first.guide.tableIndex
+           << " found twice in the binary\n";
+    return -1;
+  }
+  return (at - data) - first.guide.tableIndex * long(GuardDescSize);
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "self-checksumming patcher\n");
+
+  // We should not seek for patch guide when stats indicate no guards, see #42
+  if (!StatsPath.empty()) {
+    nlohmann::json stats;
+    std::ifstream(StatsPath) >> stats;
+    if (stats["numberOfGuards"].get<int>() == 0) {
+      outs() << "SC stats indicates there is nothing to be patched\n";
+      return 0;
+    }
+  }
+
+  std::vector<GuardPatch> guide;
+  if (!readPatchGuide(GuidePath, guide)) {
+    return 1;
+  }
+  BinaryImage image;
+  if (!image.open(BinaryPath)) {
+    return 1;
+  }
+
+  std::vector<Patch> patches;
+  patches.reserve(guide.size());
+  for (const auto &line : guide) {
+    const FunctionInfo *function = image.findFunction(line.function);
+    if (!function) {
+      errs() << "ERR: failed to find function:" << line.function << "\n";
+      return 1;
+    }
+    Patch patch;
+    patch.guide = line;
+    patch.addressTarget = function->address;
+    patch.sizeTarget = function->size;
+    patches.push_back(patch);
+  }
+
+  std::vector<uint32_t> placeholders;
+  const Patch *firstTablePatch = nullptr;
+  for (const auto &patch : patches) {
+    if (patch.guide.tableIndex >= 0) {
+      if (!firstTablePatch) {
+        firstTablePatch = &patch;
+      }
+      continue;
+    }
+    placeholders.push_back(patch.guide.addressPlaceholder);
+    placeholders.push_back(patch.guide.sizePlaceholder);
+    placeholders.push_back(patch.guide.hashPlaceholder);
+  }
+  // find addresses before starting to patch
+  auto addresses = findAllPlaceholders(image.bytes(), image.fileSize(),
+                                       placeholders, Threads);
+  size_t missing = 0;
+  for (const auto &entry : addresses) {
+    if (entry.second.empty()) {
+      errs() << "ERR. Failed to find placeholder " << entry.first
+             << " in the binary\n";
+      ++missing;
+    } else if (entry.second.size() > 1) {
+      // all copies are patched, like dump_pipe.py does
+      errs() << "WARNING. Placeholder " << entry.first << " found "
+             << entry.second.size() << " times in the binary\n";
+    }
+  }
+  if (missing) {
+    return 1;
+  }
+  long tableBase = -1;
+  if (firstTablePatch) {
+    tableBase =
+        findGuardTable(image.bytes(), image.fileSize(), *firstTablePatch);
+    if (tableBase < 0) {
+      return 1;
+    }
+  }
+
+  size_t totalPatches = 0;
+  auto patchPlaceholder = [&](uint32_t placeholder, uint32_t target) {
+    for (size_t offset : addresses[placeholder]) {
+      writeU32(image.bytes() + offset, target);
+      ++totalPatches;
+    }
+    if (DebugPatches) {
+      outs() << "Patched " << placeholder << " with " << target << "\n";
+    }
+  };
+
+  // Addresses and sizes are known up front and patched first. The expected
+  // hashes are computed once per distinct region, and a region is hashed only
+  // after every hash placeholder inside it was patched, so each checkee is
+  // hashed exactly as it ends up in the binary.
+  std::vector<HashRegion> regions;
+  std::map<std::tuple<uint64_t, uint64_t, GuardHash>, size_t> regionIndex;
+  for (size_t i = 0; i < patches.size(); ++i) {
+    auto &patch = patches[i];
+    const uint8_t *checkee =
+        image.atAddress(patch.addressTarget, patch.sizeTarget);
+    if (!checkee) {
+      errs() << "ERR. " << patch.guide.function
+             << " is not backed by the file\n";
+      return 1;
+    }
+    if (patch.guide.tableIndex >= 0) {
+      size_t entryOffset =
+          tableBase + patch.guide.tableIndex * GuardDescSize;
+      uint8_t *entry = image.bytes() + entryOffset;
+      if (readU32(entry) != patch.guide.addressPlaceholder ||
+          readU32(entry + 4) != patch.guide.sizePlaceholder ||
+          readU32(entry + 8) != patch.guide.hashPlaceholder) {
+        errs() << "ERR. Guard descriptor " << patch.guide.tableIndex
+               << " does not hold the expected placeholders\n";
+        return 1;
+      }
+      writeU32(entry, patch.addressTarget);
+      writeU32(entry + 4, patch.sizeTarget);
+      totalPatches += 2;
+      patch.hashOffsets.push_back(entryOffset + 8);
+    } else {
+      patchPlaceholder(patch.guide.addressPlaceholder, patch.addressTarget);
+      patchPlaceholder(patch.guide.sizePlaceholder, patch.sizeTarget);
+      patch.hashOffsets = addresses[patch.guide.hashPlaceholder];
+    }
+    auto key =
+        std::make_tuple(patch.addressTarget, patch.sizeTarget, patch.guide.hash);
+    auto inserted = regionIndex.emplace(key, regions.size());
+    if (inserted.second) {
+      HashRegion region;
+      region.address = patch.addressTarget;
+      region.size = patch.sizeTarget;
+      region.hash = patch.guide.hash;
+      region.fileOffset = checkee - image.bytes();
+      regions.push_back(region);
+    }
+    patch.region = inserted.first->second;
+    regions[patch.region].patches.push_back(i);
+  }
+
+  // region dependencies: regions sorted by file offset, each hash placeholder
+  // makes the regions it lies in wait for the region it belongs to
+  std::vector<size_t> byOffset(regions.size());
+  uint64_t maxRegionSize = 0;
+  for (size_t i = 0; i < regions.size(); ++i) {
+    byOffset[i] = i;
+    maxRegionSize = std::max(maxRegionSize, regions[i].size);
+  }
+  std::sort(byOffset.begin(), byOffset.end(), [&](size_t a, size_t b) {
+    return regions[a].fileOffset < regions[b].fileOffset;
+  });
+  for (const auto &patch : patches) {
+    for (size_t offset : patch.hashOffsets) {
+      auto it = std::upper_bound(byOffset.begin(), byOffset.end(), offset + 3,
+                                 [&](size_t value, size_t region) {
+                                   return value < regions[region].fileOffset;
+                                 });
+      while (it != byOffset.begin()) {
+        auto &region = regions[*--it];
+        if (region.fileOffset + maxRegionSize <= offset) {
+          break;
+        }
+        if (region.fileOffset + region.size > offset) {
+          regions[patch.region].dependents.push_back(*it);
+          ++region.pendingPlaceholders;
+        }
+      }
+    }
+  }
+
+  auto finishRegion = [&](HashRegion &region) {
+    region.done = true;
+    for (size_t i : region.patches) {
+      auto &patch = patches[i];
+      patch.hashTarget = region.result;
+      if (patch.guide.tableIndex >= 0) {
+        writeU32(image.bytes() + patch.hashOffsets.front(), region.result);
+        ++totalPatches;
+      } else {
+        patchPlaceholder(patch.guide.hashPlaceholder, region.result);
+      }
+    }
+    for (size_t dependent : region.dependents) {
+      --regions[dependent].pendingPlaceholders;
+    }
+  };
+
+  // hash the ready regions level by level on the thread pool
+  std::vector<size_t> ready;
+  for (size_t i = 0; i < regions.size(); ++i) {
+    if (!regions[i].pendingPlaceholders) {
+      ready.push_back(i);
+    }
+  }
+  size_t hashed = 0;
+  while (!ready.empty()) {
+    parallelFor(ready.size(), Threads, [&](size_t i) {
+      auto &region = regions[ready[i]];
+      region.result = computeGuardHash(
+          region.hash, image.bytes() + region.fileOffset, region.size);
+    });
+    std::vector<size_t> next;
+    for (size_t i : ready) {
+      finishRegion(regions[i]);
+      for (size_t dependent : regions[i].dependents) {
+        if (!regions[dependent].pendingPlaceholders &&
+            !regions[dependent].done) {
+          next.push_back(dependent);
+        }
+      }
+    }
+    hashed += ready.size();
+    std::sort(next.begin(), next.end());
+    next.erase(std::unique(next.begin(), next.end()), next.end());
+    ready.swap(next);
+  }
+  if (hashed != regions.size()) {
+    // guards that check each other cyclically (or a checkee holding its own
+    // guard) cannot all match, hash the rest in guide order
+    errs() << "WARNING. " << regions.size() - hashed
+           << " checkees depend on each other's hashes\n";
+    for (const auto &patch : patches) {
+      auto &region = regions[patch.region];
+      if (!region.done) {
+        region.result = computeGuardHash(
+            region.hash, image.bytes() + region.fileOffset, region.size);
+        finishRegion(region);
+      }
+    }
+  }
+  if (DebugPatches) {
+    outs() << "Hashed " << regions.size() << " distinct regions for "
+           << patches.size() << " guards\n";
+  }
+
+  size_t expectedPatches = patches.size() * 3;
+  if (totalPatches != expectedPatches) {
+    outs() << "Failed to patch all expected patches: " << expectedPatches
+           << " total patched: " << totalPatches << "\n";
+  } else {
+    outs() << "Successfuly patched all " << totalPatches << " placeholders\n";
+  }
+
+  if (!DumpPath.empty() && BinaryManifest) {
+    PatchManifest manifest;
+    uint32_t low[PatchManifest::NumKinds], high[PatchManifest::NumKinds];
+    std::fill(std::begin(low), std::end(low), UINT32_MAX);
+    std::fill(std::begin(high), std::end(high), 0);
+    for (const auto &patch : patches) {
+      uint32_t placeholders[] = {patch.guide.addressPlaceholder,
+                                 patch.guide.sizePlaceholder,
+                                 patch.guide.hashPlaceholder};
+      for (int kind = 0; kind < PatchManifest::NumKinds; ++kind) {
+        low[kind] = std::min(low[kind], placeholders[kind]);
+        high[kind] = std::max(high[kind], placeholders[kind]);
+      }
+    }
+    for (int kind = 0; kind < PatchManifest::NumKinds && !patches.empty();
+         ++kind) {
+      manifest.reserve(static_cast<PatchManifest::Kind>(kind), low[kind],
+                       high[kind]);
+    }
+    for (const auto &patch : patches) {
+      manifest.add(PatchManifest::Address, patch.guide.addressPlaceholder,
+                   patch.addressTarget);
+      manifest.add(PatchManifest::Size, patch.guide.sizePlaceholder,
+                   patch.sizeTarget);
+      manifest.add(PatchManifest::Hash, patch.guide.hashPlaceholder,
+                   patch.hashTarget);
+    }
+    if (!manifest.writeBinaryManifest(DumpPath)) {
+      errs() << "ERR. Failed to write " << DumpPath << "\n";
+      return 1;
+    }
+  } else if (!DumpPath.empty()) {
+    auto dump = nlohmann::json::array();
+    for (const auto &patch : patches) {
+      dump.push_back({{"add_placeholder", patch.guide.addressPlaceholder},
+                      {"size_placeholder", patch.guide.sizePlaceholder},
+                      {"hash_placeholder", patch.guide.hashPlaceholder},
+                      {"add_target", patch.addressTarget},
+                      {"size_target", patch.sizeTarget},
+                      {"hash_target", patch.hashTarget},
+                      {"hash_algorithm", guardHashName(patch.guide.hash)},
+                      {"table_index", patch.guide.tableIndex},
+                      {"function", patch.guide.function},
+                      {"dummy", false}});
+    }
+    std::ofstream(DumpPath) << dump;
+  }
+  return 0;
+}
@@ -1,4 +1,5 @@
 #include "self-checksumming/Stats.h"
+#include <algorithm>
 #include <numeric>
 #include <iomanip>
 
@@ -36,6 +37,11 @@ void Stats::addNumberOfGuardInstructions(int value) {
   this->numberOfGuardInstructions += value;
 }
 
+void Stats::addPhase(const std::string &name, double wallTime,
+                     double userTime, double systemTime, long peakRssKb) {
+  this->phases.push_back({name, wallTime, userTime, systemTime, peakRssKb});
+}
+
 void Stats::calculateConnectivity(std::vector<int> v) {
   double sum = std::accumulate(v.begin(), v.end(), 0.0);
   double mean = sum / v.size();
@@ -59,6 +65,15 @@ void Stats::dumpJson(const std::string &filePath) {
   j["numberOfGuards"] = this->numberOfGuards;
   j["numberOfGuardInstructions"] = this->numberOfGuardInstructions;
   j["desiredConnectivity"] = this->desiredConnectivity;
+  long peakRssKb = 0;
+  for (const auto &phase : this->phases) {
+    j["phases"][phase.name] = {{"wallTime", phase.wallTime},
+                               {"userTime", phase.userTime},
+                               {"systemTime", phase.systemTime},
+                               {"peakRssKb", phase.peakRssKb}};
+    peakRssKb = std::max(peakRssKb, phase.peakRssKb);
+  }
+  j["peakRssKb"] = peakRssKb;
   std::cout << j.dump(4) << std::endl;
   std::ofstream o(filePath);
   o << std::setw(4) << j << std::endl;
@@ -0,0 +1,114 @@
+/*
+ * Prints the live guard counters of a process protected with SC_TELEMETRY=1.
+ *
+ *   sc-telemetry <pid> [interval-seconds]
+ *
+ * The telemetry object is mapped read-only, the process is never stopped.
+ * Without an interval one snapshot is printed, with one the snapshot is
+ * refreshed until the process exits. p50/p99 are the upper bounds of the
+ * histogram buckets the hash times fall into.
+ */
+#include "sc_telemetry.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static const char *algorithms[] = {"xor", "crc32c", "adler32", "mix64"};
+
+static uint64_t load(const uint64_t *counter) {
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// upper bound in ns of the bucket that holds the given fraction of hashes
+static uint64_t percentile(const uint64_t *buckets, uint64_t total,
+                           double fraction) {
+  uint64_t rank = (uint64_t) (total * fraction), seen = 0;
+  unsigned int bucket;
+  for (bucket = 0; bucket < SC_TELEMETRY_BUCKETS; ++bucket) {
+    seen += buckets[bucket];
+    if (seen > rank)
+      break;
+  }
+  if (bucket >= SC_TELEMETRY_BUCKETS - 1)
+    bucket = SC_TELEMETRY_BUCKETS - 1;
+  return (uint64_t) 1 << bucket;
+}
+
+static void print_snapshot(const struct sc_telemetry *telemetry) {
+  unsigned int i, bucket;
+  printf("%-10s %8s %-8s %12s %12s %12s %10s %10s\n", "address", "length",
+         "hash", "calls", "hashes", "cache_hits", "p50_ns", "p99_ns");
+  for (i = 0; i < telemetry->slots && i < SC_TELEMETRY_SLOTS; ++i) {
+    const struct sc_telemetry_slot *slot = &telemetry->slot[i];
+    uint32_t tag = __atomic_load_n(&slot->tag, __ATOMIC_ACQUIRE);
+    if (tag == 0 || tag == SC_TELEMETRY_CLAIMING)
+      continue;
+    uint64_t buckets[SC_TELEMETRY_BUCKETS], hashed = 0;
+    for (bucket = 0; bucket < SC_TELEMETRY_BUCKETS; ++bucket) {
+      buckets[bucket] = load(&slot->hash_ns[bucket]);
+      hashed += buckets[bucket];
+    }
+    printf("0x%08x %8u %-8s %12llu %12llu %12llu", slot->address,
+           slot->length,
+           slot->algorithm < 4 ? algorithms[slot->algorithm] : "?",
+           (unsigned long long) load(&slot->calls),
+           (unsigned long long) load(&slot->hashes),
+           (unsigned long long) load(&slot->cache_hits));
+    if (hashed) {
+      printf(" %10llu %10llu\n",
+             (unsigned long long) percentile(buckets, hashed, 0.5),
+             (unsigned long long) percentile(buckets, hashed, 0.99));
+    } else {
+      printf(" %10s %10s\n", "-", "-");
+    }
+  }
+  uint64_t overflow = load(&telemetry->overflow);
+  if (overflow)
+    printf("%llu calls of guards without a telemetry slot\n",
+           (unsigned long long) overflow);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "usage: %s <pid> [interval-seconds]\n", argv[0]);
+    return 2;
+  }
+  int pid = atoi(argv[1]);
+  unsigned int interval = argc == 3 ? (unsigned int) atoi(argv[2]) : 0;
+  char name[32];
+  snprintf(name, sizeof(name), SC_TELEMETRY_NAME, pid);
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    fprintf(stderr, "ERR. %s not found, is %d running with SC_TELEMETRY=1?\n",
+            name, pid);
+    return 1;
+  }
+  void *mapping = mmap(NULL, sizeof(struct sc_telemetry), PROT_READ,
+                       MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  const struct sc_telemetry *telemetry = mapping;
+  if (__atomic_load_n(&telemetry->magic, __ATOMIC_ACQUIRE) !=
+      SC_TELEMETRY_MAGIC) {
+    fprintf(stderr, "ERR. %s is not a guard telemetry object\n", name);
+    return 1;
+  }
+  for (;;) {
+    if (interval)
+      printf("\033[H\033[J");
+    printf("pid %llu\n", (unsigned long long) telemetry->pid);
+    print_snapshot(telemetry);
+    fflush(stdout);
+    if (!interval || kill(pid, 0) != 0)
+      break;
+    sleep(interval);
+  }
+  munmap(mapping, sizeof(struct sc_telemetry));
+  return 0;
+}
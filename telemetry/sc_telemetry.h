@@ -0,0 +1,44 @@
+#ifndef SC_TELEMETRY_H
+#define SC_TELEMETRY_H
+
+#include <stdint.h>
+
+/*
+ * Layout of the live guard telemetry a protected process publishes with
+ * SC_TELEMETRY=1 (see rtlib.c), read by sc-telemetry.
+ *
+ * The shared memory object /sc-telemetry.<pid> holds a header followed by
+ * slots guards are hashed into by their region. A guard claims a slot by
+ * swapping its tag from 0 to SC_TELEMETRY_CLAIMING, fills in the region and
+ * publishes its tag last, so a reader that sees a tag sees the region.
+ * Every counter is a 64-bit word the process only ever adds to atomically;
+ * readers load them without stopping the process and a snapshot is at worst
+ * a few calls behind between two counters.
+ */
+#define SC_TELEMETRY_MAGIC 0x31544353u /* "SCT1" */
+#define SC_TELEMETRY_SLOTS 4096
+#define SC_TELEMETRY_CLAIMING 2u /* region tags are odd */
+/* bucket b counts hash times below 2^b ns, the last bucket the rest */
+#define SC_TELEMETRY_BUCKETS 32
+#define SC_TELEMETRY_NAME "/sc-telemetry.%d"
+
+struct sc_telemetry_slot {
+  uint32_t tag; /* 0 marks a free slot */
+  uint32_t address;
+  uint32_t length;
+  uint32_t algorithm; /* enum sc_hash_kind */
+  uint64_t calls;      /* guard calls, including rate-limited ones */
+  uint64_t hashes;     /* hashing passes, one per chunk for chunked guards */
+  uint64_t cache_hits; /* calls the verification cache answered */
+  uint64_t hash_ns[SC_TELEMETRY_BUCKETS];
+};
+
+struct sc_telemetry {
+  uint32_t magic;
+  uint32_t slots;
+  uint64_t pid;
+  uint64_t overflow; /* calls of guards that found no free slot */
+  struct sc_telemetry_slot slot[SC_TELEMETRY_SLOTS];
+};
+
+#endif